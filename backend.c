@@ -0,0 +1,497 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include "backend.h"
+
+/*
+ * Talking to a long-running application server over a Unix socket,
+ * instead of starting a CGI for every request.
+ *
+ * FastCGI connections are asked to stay open, and go back in a pool
+ * when the response is over, so a busy worker hardly ever connects.
+ * SCGI gets one connection per request, since that's all it knows.
+ *
+ * Everything here blocks.  Sockets get send and receive timeouts,
+ * so a stuck application server shows up as EAGAIN.
+ */
+
+#define BACKEND_POOL 64                 /* idle connections kept per process */
+
+enum { SCGI, FCGI };
+
+#define FCGI_BEGIN_REQUEST 1
+#define FCGI_END_REQUEST 3
+#define FCGI_PARAMS 4
+#define FCGI_STDIN 5
+#define FCGI_STDOUT 6
+#define FCGI_STDERR 7
+#define FCGI_RESPONDER 1
+#define FCGI_KEEP_CONN 1
+#define FCGI_MAXRECORD 65535
+#define FCGI_ID 1                       /* one request per connection at a time */
+
+static int proto;
+static struct sockaddr_un addr;
+static struct timeval timeout;
+
+static int idle[BACKEND_POOL];
+static int nidle;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * spec is "fcgi:/path/to/socket" or "scgi:/path/to/socket".
+ * timeout is how many seconds the server gets to say something.
+ */
+int
+backend_init(const char *spec, int secs)
+{
+    const char *path = strchr(spec, ':');
+
+    if (path && (path - spec == 4) && !strncmp(spec, "scgi", 4)) {
+        proto = SCGI;
+    } else if (path && (path - spec == 4) && !strncmp(spec, "fcgi", 4)) {
+        proto = FCGI;
+    } else {
+        errno = EINVAL;
+        return -1;
+    }
+    path += 1;
+    if (strlen(path) >= sizeof addr.sun_path) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    timeout.tv_sec = secs;
+    return 0;
+}
+
+/*
+ * Forget the pool in a forked child: the parent is still using it
+ */
+void
+backend_forked(void)
+{
+    while (nidle) {
+        close(idle[--nidle]);
+    }
+}
+
+/*
+ * Can the request body go out without knowing its length first?
+ * SCGI puts CONTENT_LENGTH up front; FastCGI just ends STDIN.
+ */
+int
+backend_streams(void)
+{
+    return proto == FCGI;
+}
+
+static int
+connect_fresh(void)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (-1 == fd) {
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof addr)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Get a connection, out of the pool if there's a live one
+ */
+int
+backend_open(struct backend *b)
+{
+    memset(b, 0, sizeof *b);
+    b->fd = -1;
+
+    while (proto == FCGI) {
+        struct pollfd pfd;
+
+        pthread_mutex_lock(&lock);
+        if (nidle) {
+            pfd.fd = idle[--nidle];
+        } else {
+            pfd.fd = -1;
+        }
+        pthread_mutex_unlock(&lock);
+        if (-1 == pfd.fd) {
+            break;
+        }
+
+        /*
+         * Anything to read on an idle connection means it hung up
+         */
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, 0) == 0) {
+            b->fd = pfd.fd;
+            b->reused = 1;
+            return 0;
+        }
+        close(pfd.fd);
+    }
+
+    b->fd = connect_fresh();
+    return (b->fd == -1) ? -1 : 0;
+}
+
+static int
+send_all(int fd, struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg = {0};
+
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    while (msg.msg_iovlen) {
+        ssize_t len = sendmsg(fd, &msg, MSG_NOSIGNAL);
+
+        if (-1 == len) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        while (msg.msg_iovlen && (len >= msg.msg_iov->iov_len)) {
+            len -= msg.msg_iov->iov_len;
+            msg.msg_iov += 1;
+            msg.msg_iovlen -= 1;
+        }
+        if (msg.msg_iovlen) {
+            msg.msg_iov->iov_base = (char *) msg.msg_iov->iov_base + len;
+            msg.msg_iov->iov_len -= len;
+        }
+    }
+    return 0;
+}
+
+static int
+recv_all(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+
+    while (len) {
+        ssize_t n = recv(fd, p, len, 0);
+
+        if ((-1 == n) && (errno == EINTR)) {
+            continue;
+        }
+        if (n < 1) {
+            if (0 == n) {
+                errno = ECONNRESET;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void
+fcgi_header(unsigned char *h, int type, size_t len)
+{
+    h[0] = 1;
+    h[1] = type;
+    h[2] = FCGI_ID >> 8;
+    h[3] = FCGI_ID & 0xff;
+    h[4] = len >> 8;
+    h[5] = len & 0xff;
+    h[6] = 0;
+    h[7] = 0;
+}
+
+/*
+ * Send one FastCGI stream record; len 0 ends the stream
+ */
+static int
+fcgi_record(int fd, int type, const void *buf, size_t len)
+{
+    unsigned char h[8];
+    struct iovec iov[2];
+
+    fcgi_header(h, type, len);
+    iov[0].iov_base = h;
+    iov[0].iov_len = sizeof h;
+    iov[1].iov_base = (void *) buf;
+    iov[1].iov_len = len;
+    return send_all(fd, iov, len ? 2 : 1);
+}
+
+static void
+grow(struct backend *b, size_t len)
+{
+    if (b->paramslen + len > b->paramssize) {
+        size_t size = b->paramssize ? b->paramssize : 4096;
+        char *p;
+
+        while (size < b->paramslen + len) {
+            size *= 2;
+        }
+        if (!(p = realloc(b->params, size))) {
+            fprintf(stderr, "Out of memory.  Dying.\n");
+            exit(1);
+        }
+        b->params = p;
+        b->paramssize = size;
+    }
+}
+
+static void
+fcgi_length(struct backend *b, size_t len)
+{
+    unsigned char *p = (unsigned char *) b->params + b->paramslen;
+
+    if (len < 128) {
+        p[0] = len;
+        b->paramslen += 1;
+    } else {
+        p[0] = (len >> 24) | 0x80;
+        p[1] = len >> 16;
+        p[2] = len >> 8;
+        p[3] = len;
+        b->paramslen += 4;
+    }
+}
+
+/*
+ * Add a variable to the request's parameters
+ */
+void
+backend_param(struct backend *b, const char *name, const char *val)
+{
+    size_t nlen = strlen(name);
+    size_t vlen = strlen(val);
+
+    grow(b, nlen + vlen + 8);
+    if (proto == SCGI) {
+        /*
+         * backend_begin() puts this first, where SCGI wants it
+         */
+        if (!strcmp(name, "CONTENT_LENGTH")) {
+            return;
+        }
+        memcpy(b->params + b->paramslen, name, nlen + 1);
+        b->paramslen += nlen + 1;
+        memcpy(b->params + b->paramslen, val, vlen + 1);
+        b->paramslen += vlen + 1;
+    } else {
+        fcgi_length(b, nlen);
+        fcgi_length(b, vlen);
+        memcpy(b->params + b->paramslen, name, nlen);
+        b->paramslen += nlen;
+        memcpy(b->params + b->paramslen, val, vlen);
+        b->paramslen += vlen;
+    }
+}
+
+static int
+begin(struct backend *b, size_t content_length)
+{
+    if (proto == SCGI) {
+        char head[64], cl[64];
+        int cllen = snprintf(cl, sizeof cl, "CONTENT_LENGTH%c%zu%cSCGI%c1%c", 0, content_length, 0, 0, 0);
+        int headlen = snprintf(head, sizeof head, "%zu:", cllen + b->paramslen);
+        struct iovec iov[4] = {
+            {head, headlen},
+            {cl, cllen},
+            {b->params, b->paramslen},
+            {",", 1},
+        };
+
+        return send_all(b->fd, iov, 4);
+    } else {
+        unsigned char h[16] = {0};
+        size_t off = 0;
+
+        fcgi_header(h, FCGI_BEGIN_REQUEST, 8);
+        h[9] = FCGI_RESPONDER;
+        h[10] = FCGI_KEEP_CONN;
+        {
+            struct iovec iov = {h, sizeof h};
+
+            if (send_all(b->fd, &iov, 1)) {
+                return -1;
+            }
+        }
+        while (off < b->paramslen) {
+            size_t len = b->paramslen - off;
+
+            if (len > FCGI_MAXRECORD) {
+                len = FCGI_MAXRECORD;
+            }
+            if (fcgi_record(b->fd, FCGI_PARAMS, b->params + off, len)) {
+                return -1;
+            }
+            off += len;
+        }
+        return fcgi_record(b->fd, FCGI_PARAMS, NULL, 0);
+    }
+}
+
+/*
+ * Start the request, once all the parameters are in.
+ *
+ * If a pooled connection turns out to be dead,
+ * this tries again on a new one.
+ */
+int
+backend_begin(struct backend *b, size_t content_length)
+{
+    while (begin(b, content_length)) {
+        if (!b->reused) {
+            return -1;
+        }
+        close(b->fd);
+        b->reused = 0;
+        if (-1 == (b->fd = connect_fresh())) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Send some of the request body; len 0 means that's all of it
+ */
+int
+backend_write(struct backend *b, const char *buf, size_t len)
+{
+    if (proto == SCGI) {
+        struct iovec iov = {(void *) buf, len};
+
+        return len ? send_all(b->fd, &iov, 1) : 0;
+    }
+    return fcgi_record(b->fd, FCGI_STDIN, buf, len);
+}
+
+/*
+ * Read some of the response.
+ * Returns 0 when it's over, and -1 on error.
+ */
+ssize_t
+backend_read(struct backend *b, char *buf, size_t len)
+{
+    if (b->ended) {
+        return 0;
+    }
+    if (proto == SCGI) {
+        ssize_t n;
+
+        do {
+            n = recv(b->fd, buf, len, 0);
+        } while ((-1 == n) && (errno == EINTR));
+        if (0 == n) {
+            b->ended = 1;
+        }
+        return n;
+    }
+
+    while (1) {
+        unsigned char h[8];
+
+        if (b->content) {
+            size_t want = (b->content < len) ? b->content : len;
+            ssize_t n;
+
+            if (b->type == FCGI_STDOUT) {
+                do {
+                    n = recv(b->fd, buf, want, 0);
+                } while ((-1 == n) && (errno == EINTR));
+                if (n < 1) {
+                    if (0 == n) {
+                        errno = ECONNRESET;
+                    }
+                    return -1;
+                }
+                b->content -= n;
+                return n;
+            }
+
+            /*
+             * Anything else gets read into buf and looked at here
+             */
+            if (recv_all(b->fd, buf, want)) {
+                return -1;
+            }
+            b->content -= want;
+            if (b->type == FCGI_STDERR) {
+                fwrite(buf, 1, want, stderr);
+            } else if ((b->type == FCGI_END_REQUEST) && (want >= 5) && !b->content) {
+                /*
+                 * protocolStatus is 0 if the request went through
+                 */
+                b->keep = (buf[4] == 0);
+                b->ended = 1;
+            }
+            continue;
+        }
+        if (b->padding) {
+            char pad[256];
+
+            if (recv_all(b->fd, pad, b->padding)) {
+                return -1;
+            }
+            b->padding = 0;
+        }
+        if (b->ended) {
+            return 0;
+        }
+
+        if (recv_all(b->fd, h, sizeof h)) {
+            return -1;
+        }
+        b->type = h[1];
+        b->content = (h[4] << 8) | h[5];
+        b->padding = h[6];
+        if ((b->type == FCGI_END_REQUEST) && (b->content < 8)) {
+            /*
+             * Too short to be a real one
+             */
+            errno = EPROTO;
+            return -1;
+        }
+    }
+}
+
+/*
+ * Done with the request.  The connection goes back in the pool
+ * if the whole response came through.
+ */
+void
+backend_close(struct backend *b)
+{
+    if (b->fd != -1) {
+        int pooled = 0;
+
+        if ((proto == FCGI) && b->ended && b->keep && !b->padding) {
+            pthread_mutex_lock(&lock);
+            if (nidle < BACKEND_POOL) {
+                idle[nidle++] = b->fd;
+                pooled = 1;
+            }
+            pthread_mutex_unlock(&lock);
+        }
+        if (!pooled) {
+            close(b->fd);
+        }
+        b->fd = -1;
+    }
+    free(b->params);
+    b->params = NULL;
+    b->paramslen = b->paramssize = 0;
+}
@@ -0,0 +1,32 @@
+#ifndef __BACKEND_H__
+#define __BACKEND_H__
+
+#include <sys/types.h>
+
+/*
+ * One request to a FastCGI or SCGI application server
+ */
+struct backend {
+    int fd;                     /* -1 when there isn't one */
+    int reused;                 /* fd came out of the pool */
+    int ended;                  /* the whole response has been read */
+    int keep;                   /* fd can go back in the pool */
+    int type;                   /* FastCGI: record being read */
+    size_t content;             /* FastCGI: bytes left in that record */
+    size_t padding;             /* FastCGI: padding after them */
+    char *params;
+    size_t paramslen, paramssize;
+};
+
+int backend_init(const char *spec, int timeout);
+void backend_forked(void);
+int backend_streams(void);
+
+int backend_open(struct backend *b);
+void backend_param(struct backend *b, const char *name, const char *val);
+int backend_begin(struct backend *b, size_t content_length);
+int backend_write(struct backend *b, const char *buf, size_t len);
+ssize_t backend_read(struct backend *b, char *buf, size_t len);
+void backend_close(struct backend *b);
+
+#endif
@@ -0,0 +1,182 @@
+/** echo-backend - tiny FastCGI/SCGI application server
+  *
+  * Usage: echo-backend fcgi|scgi SOCKET
+  *
+  * Answers every request with its parameters, one per line,
+  * followed by the request body.  REQUEST=n says how many
+  * requests have come in over this connection so far, which
+  * shows whether the web server is reusing connections.
+  *
+  * This exists to test eris -b, and as a starting point:
+  * it is not a real application server.
+  */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static FILE *in, *out;
+static int requests;
+
+static int
+get(void *buf, size_t len)
+{
+    return fread(buf, 1, len, in) == len;
+}
+
+static size_t
+fcgi_len(unsigned char **p)
+{
+    size_t len = (*p)[0];
+
+    if (len & 0x80) {
+        len = (((*p)[0] & 0x7f) << 24) | ((*p)[1] << 16) | ((*p)[2] << 8) | (*p)[3];
+        *p += 4;
+    } else {
+        *p += 1;
+    }
+    return len;
+}
+
+static void
+fcgi_send(int type, const char *buf, size_t len)
+{
+    unsigned char h[8] = {1, type, 0, 1, len >> 8, len & 0xff, 0, 0};
+
+    fwrite(h, 1, 8, out);
+    fwrite(buf, 1, len, out);
+}
+
+static void
+fcgi(void)
+{
+    static char body[1 << 16];
+    size_t bodylen = 0;
+    char resp[1 << 16];
+    size_t resplen = 0;
+    unsigned char h[8], c[1 << 16];
+
+    while (get(h, 8)) {
+        size_t len = (h[4] << 8) | h[5];
+
+        if (!get(c, len + h[6])) {
+            break;
+        }
+        switch (h[1]) {
+        case 1:                /* BEGIN_REQUEST */
+            requests += 1;
+            bodylen = 0;
+            resplen = snprintf(resp, sizeof resp, "Content-type: text/plain\n\nREQUEST=%d\n", requests);
+            break;
+        case 4:                /* PARAMS */
+            {
+                unsigned char *p = c;
+
+                while (p < c + len) {
+                    size_t nlen = fcgi_len(&p);
+                    size_t vlen = fcgi_len(&p);
+
+                    resplen += snprintf(resp + resplen, sizeof resp - resplen, "%.*s=%.*s\n",
+                                        (int) nlen, p, (int) vlen, p + nlen);
+                    if (resplen >= sizeof resp) {
+                        resplen = sizeof resp - 1;
+                    }
+                    p += nlen + vlen;
+                }
+            }
+            break;
+        case 5:                /* STDIN */
+            if (len) {
+                if (bodylen + len <= sizeof body) {
+                    memcpy(body + bodylen, c, len);
+                    bodylen += len;
+                }
+                break;
+            }
+            fcgi_send(6, resp, resplen);
+            if (bodylen) {
+                fcgi_send(6, body, bodylen);
+            }
+            fcgi_send(6, NULL, 0);
+            fcgi_send(3, "\0\0\0\0\0\0\0\0", 8);
+            fflush(out);
+            break;
+        }
+    }
+}
+
+static void
+scgi(void)
+{
+    char buf[1 << 16], *p;
+    size_t len, cl = 0;
+
+    if (fscanf(in, "%zu:", &len) != 1 || len >= sizeof buf || !get(buf, len + 1)) {
+        return;
+    }
+    requests += 1;
+    printf("Content-type: text/plain\n\nREQUEST=%d\n", requests);
+    for (p = buf; p < buf + len;) {
+        char *val = p + strlen(p) + 1;
+
+        printf("%s=%s\n", p, val);
+        if (!strcmp(p, "CONTENT_LENGTH")) {
+            cl = atol(val);
+        }
+        p = val + strlen(val) + 1;
+    }
+    while (cl > 0) {
+        size_t n = fread(buf, 1, (cl < sizeof buf) ? cl : sizeof buf, in);
+
+        if (!n) {
+            break;
+        }
+        fwrite(buf, 1, n, stdout);
+        cl -= n;
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct sockaddr_un addr = {AF_UNIX};
+    int fd;
+
+    if ((argc != 3) || (strlen(argv[2]) >= sizeof addr.sun_path)) {
+        fprintf(stderr, "Usage: %s fcgi|scgi SOCKET\n", argv[0]);
+        return 64;
+    }
+    strcpy(addr.sun_path, argv[2]);
+    unlink(argv[2]);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if ((-1 == fd) || bind(fd, (struct sockaddr *) &addr, sizeof addr) || listen(fd, 16)) {
+        perror(argv[2]);
+        return 69;
+    }
+    signal(SIGCHLD, SIG_IGN);
+
+    while (1) {
+        int c = accept(fd, NULL, NULL);
+
+        if (-1 == c) {
+            continue;
+        }
+        if (fork() == 0) {
+            close(fd);
+            in = fdopen(c, "r");
+            out = fdopen(dup(c), "w");
+            if (!strcmp(argv[1], "scgi")) {
+                dup2(c, 1);
+                scgi();
+                fflush(stdout);
+            } else {
+                fcgi();
+            }
+            return 0;
+        }
+        close(c);
+    }
+}
@@ -0,0 +1,377 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stddef.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "strings.h"
+#include "dcache.h"
+
+/*
+ * Directory listings, rendered once.
+ *
+ * A listing is the rows for a directory's entries, sorted by name,
+ * kept by the directory's device, inode and mtime.  Anything that adds,
+ * removes or renames an entry changes the mtime, which is all the
+ * checking a repeat hit needs: it never reads the directory.  A file
+ * changing size in place doesn't touch the mtime, so sizes in a kept
+ * listing can be behind until something else in there changes.
+ *
+ * A directory that changed within the last second isn't kept,
+ * since the next change might not move the mtime along.
+ *
+ * Listings count against maxbytes, and the least recently used ones
+ * go when it's exceeded.
+ */
+
+#define DCACHE_BUCKETS 1024
+#define GETDENTS_SIZE (64 * 1024)
+
+static int enabled = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct dlist lru = { .prev = &lru, .next = &lru };
+static struct dlist *buckets[DCACHE_BUCKETS];
+static size_t bytes, maxbytes;
+
+static struct dlist **
+bucket(dev_t dev, ino_t ino)
+{
+    return &buckets[(ino ^ (dev * 31)) & (DCACHE_BUCKETS - 1)];
+}
+
+static void
+evict(struct dlist *l)
+{
+    struct dlist **p;
+
+    for (p = bucket(l->dev, l->ino); *p != l; p = &(*p)->hnext);
+    *p = l->hnext;
+    l->prev->next = l->next;
+    l->next->prev = l->prev;
+    bytes -= l->len;
+
+    if (l->refs) {
+        l->dead = 1;
+    } else {
+        free(l);
+    }
+}
+
+/*
+ * Start keeping up to nbytes of listings.
+ */
+void
+dcache_init(size_t nbytes)
+{
+    maxbytes = nbytes;
+    enabled = (nbytes > 0);
+}
+
+/*
+ * In a child process the lock might be held.  Leave it all alone.
+ */
+void
+dcache_forked(void)
+{
+    enabled = 0;
+}
+
+/*
+ * What the directory holds, before it gets sorted
+ */
+struct ent {
+    size_t name;                /* offset into names */
+    unsigned char type;         /* d_type */
+};
+
+struct buf {
+    char *p;
+    size_t len, size;
+};
+
+static int
+grow(struct buf *b, size_t len)
+{
+    if (b->len + len > b->size) {
+        size_t size = b->size ? b->size : 4096;
+        char *p;
+
+        while (size < b->len + len) {
+            size *= 2;
+        }
+        if (!(p = realloc(b->p, size))) {
+            return -1;
+        }
+        b->p = p;
+        b->size = size;
+    }
+    return 0;
+}
+
+static int
+entcmp(const void *a, const void *b, void *names)
+{
+    return strcmp((char *) names + ((const struct ent *) a)->name, (char *) names + ((const struct ent *) b)->name);
+}
+
+/*
+ * Every entry that isn't hidden, with the type getdents64 gives it.
+ * Returns the number of entries, or -1 (with errno EFBIG if there
+ * are more than maxents, unless that's 0).
+ */
+static ssize_t
+read_entries(int fd, struct buf *ents, struct buf *names, size_t maxents)
+{
+    char *dents = malloc(GETDENTS_SIZE);
+    size_t n = 0;
+
+    if (!dents) {
+        return -1;
+    }
+    lseek(fd, 0, SEEK_SET);
+    while (1) {
+        long len = syscall(SYS_getdents64, fd, dents, GETDENTS_SIZE);
+        long off;
+
+        if (len < 1) {
+            free(dents);
+            return (len == 0) ? n : -1;
+        }
+        for (off = 0; off < len;) {
+            struct dirent64 *d = (struct dirent64 *) (dents + off);
+            size_t namelen = strlen(d->d_name) + 1;
+            struct ent *e;
+
+            off += d->d_reclen;
+            if (d->d_name[0] == '.') {
+                continue;       /* hidden files -> skip */
+            }
+            if (maxents && (n == maxents)) {
+                free(dents);
+                errno = EFBIG;
+                return -1;
+            }
+            if (grow(ents, sizeof *e) || grow(names, namelen)) {
+                free(dents);
+                return -1;
+            }
+            e = (struct ent *) (ents->p + ents->len);
+            e->name = names->len;
+            e->type = d->d_type;
+            memcpy(names->p + names->len, d->d_name, namelen);
+            ents->len += sizeof *e;
+            names->len += namelen;
+            n += 1;
+        }
+    }
+}
+
+/*
+ * Add the row for one entry to html.
+ * Directories and symlinks don't need a stat: getdents64 said what they are.
+ */
+static int
+render_entry(int fd, const char *name, unsigned char type, struct buf *html)
+{
+    char esc[PATH_MAX * 3];
+    char symlink[PATH_MAX];
+    char size[24];
+    const char *what = size;
+    int len;
+
+    if (type == DT_UNKNOWN) {
+        struct statx stx;
+
+        if (statx(fd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC, STATX_TYPE | STATX_SIZE, &stx)) {
+            return 0;           /* can't stat -> skip */
+        }
+        type = IFTODT(stx.stx_mode);
+    }
+
+    switch (type) {
+    case DT_DIR:
+        what = "[DIR]\t ";
+        break;
+    case DT_LNK:
+        {
+            ssize_t n = readlinkat(fd, name, symlink, sizeof symlink - 1);
+
+            if (n < 1) {
+                return 0;
+            }
+            symlink[n] = 0;
+            name = symlink;
+            what = "[LNK]\t ";
+        }
+        break;
+    case DT_REG:
+        {
+            struct statx stx;
+
+            if (statx(fd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC, STATX_SIZE, &stx)) {
+                return 0;
+            }
+            snprintf(size, sizeof size, "%10llu", (unsigned long long) stx.stx_size);
+        }
+        break;
+    default:
+        return 0;               /* not a file we can provide -> skip */
+    }
+
+    url_esc(esc, sizeof esc, name);
+    if (grow(html, 2 * strlen(esc) + 64)) {
+        return -1;
+    }
+    len = sprintf(html->p + html->len, "%s  <a href=\"%s%s\">%s</a>\n",
+                  what, esc, (type == DT_DIR) ? "/" : "", esc);
+    html->len += len;
+    return 0;
+}
+
+/*
+ * Read and render the directory fd, which st describes
+ */
+static struct dlist *
+render(int fd, const struct stat *st, size_t maxents)
+{
+    struct buf ents = { 0 }, names = { 0 }, html = { 0 };
+    struct dlist *l = NULL;
+    ssize_t n, i;
+
+    if (grow(&html, offsetof(struct dlist, html))) {
+        return NULL;
+    }
+    html.len = offsetof(struct dlist, html);
+
+    n = read_entries(fd, &ents, &names, maxents);
+    if (n > 0) {
+        struct ent *e = (struct ent *) ents.p;
+
+        qsort_r(e, n, sizeof *e, entcmp, names.p);
+        for (i = 0; i < n; i += 1) {
+            if (render_entry(fd, names.p + e[i].name, e[i].type, &html)) {
+                n = -1;
+                break;
+            }
+        }
+    }
+    free(ents.p);
+    free(names.p);
+    if (n < 0) {
+        free(html.p);
+        return NULL;
+    }
+
+    l = (struct dlist *) html.p;
+    memset(l, 0, offsetof(struct dlist, html));
+    l->len = html.len - offsetof(struct dlist, html);
+    l->dev = st->st_dev;
+    l->ino = st->st_ino;
+    l->mtime = st->st_mtim;
+    l->refs = 1;
+    return l;
+}
+
+/*
+ * The listing for the directory open on dirfd, from the cache if
+ * it's still good there.  If it has to be read and has more than
+ * maxents entries (0 for no limit), that's left for the caller to do
+ * somewhere it can take its time.
+ *
+ * Returns a reference the caller has to dcache_release(), or NULL
+ * (with errno EFBIG for a directory past maxents).
+ */
+struct dlist *
+dcache_get(int dirfd, size_t maxents)
+{
+    struct stat st;
+    struct dlist *l;
+
+    if (fstat(dirfd, &st)) {
+        return NULL;
+    }
+
+    if (enabled) {
+        pthread_mutex_lock(&lock);
+        for (l = *bucket(st.st_dev, st.st_ino); l; l = l->hnext) {
+            if ((l->ino == st.st_ino) && (l->dev == st.st_dev)) {
+                break;
+            }
+        }
+        if (l && (l->mtime.tv_sec == st.st_mtim.tv_sec) && (l->mtime.tv_nsec == st.st_mtim.tv_nsec)) {
+            l->refs += 1;
+            l->prev->next = l->next;
+            l->next->prev = l->prev;
+            l->next = lru.next;
+            l->prev = &lru;
+            lru.next->prev = l;
+            lru.next = l;
+            pthread_mutex_unlock(&lock);
+            return l;
+        }
+        if (l) {
+            evict(l);
+        }
+        pthread_mutex_unlock(&lock);
+    }
+
+    if (!(l = render(dirfd, &st, maxents))) {
+        return NULL;
+    }
+
+    if (enabled && (l->len <= maxbytes) && (st.st_mtime < time(NULL) - 1)) {
+        pthread_mutex_lock(&lock);
+        for (;;) {
+            struct dlist *o;
+
+            for (o = *bucket(l->dev, l->ino); o; o = o->hnext) {
+                if ((o->ino == l->ino) && (o->dev == l->dev)) {
+                    break;
+                }
+            }
+            if (!o) {
+                break;
+            }
+            evict(o);           /* somebody else got here first */
+        }
+        while (bytes + l->len > maxbytes) {
+            evict(lru.prev);
+        }
+        l->cached = 1;
+        l->hnext = *bucket(l->dev, l->ino);
+        *bucket(l->dev, l->ino) = l;
+        l->next = lru.next;
+        l->prev = &lru;
+        lru.next->prev = l;
+        lru.next = l;
+        bytes += l->len;
+        pthread_mutex_unlock(&lock);
+    }
+    return l;
+}
+
+void
+dcache_release(struct dlist *l)
+{
+    int last;
+
+    if (!l->cached) {
+        free(l);
+        return;
+    }
+    pthread_mutex_lock(&lock);
+    l->refs -= 1;
+    last = l->dead && !l->refs;
+    pthread_mutex_unlock(&lock);
+    if (last) {
+        free(l);
+    }
+}
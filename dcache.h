@@ -0,0 +1,30 @@
+#ifndef __DCACHE_H__
+#define __DCACHE_H__
+
+#include <sys/types.h>
+#include <time.h>
+
+/*
+ * The rows of a directory listing, ready to go out.
+ * Read-only once dcache_get() returns it.
+ */
+struct dlist {
+    size_t len;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+
+    struct dlist *prev, *next;  /* LRU list */
+    struct dlist *hnext;        /* hash chain */
+    int refs;
+    int cached;                 /* in the cache, or on its way out of it */
+    int dead;                   /* evicted, free at last release */
+    char html[];
+};
+
+void dcache_init(size_t maxbytes);
+void dcache_forked(void);
+struct dlist *dcache_get(int dirfd, size_t maxents);
+void dcache_release(struct dlist *l);
+
+#endif
@@ -0,0 +1,5 @@
+#! /bin/sh
+echo 'Content-type: text/plain'
+echo
+set | sort
+ls *.cgi
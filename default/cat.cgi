@@ -0,0 +1,4 @@
+#! /bin/sh
+echo 'Content-type: application/octet-stream'
+echo
+cat
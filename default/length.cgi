@@ -0,0 +1,5 @@
+#! /bin/sh
+echo 'Content-type: text/plain'
+echo 'Content-Length: 6'
+echo
+echo james
@@ -0,0 +1,5 @@
+#! /bin/sh
+echo 'Content-type: application/octet-stream'
+echo
+dd if=/dev/zero bs=1000 count=800 2>/dev/null
+echo 'james'
@@ -0,0 +1,2 @@
+#! /bin/sh
+echo "Location: http://example.com/froot"
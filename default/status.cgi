@@ -0,0 +1,16 @@
+#! /bin/sh
+case "$PATH_INFO" in
+/empty)
+	echo "Status"
+	exit 0
+	;;
+/nostat)
+	echo "Status: "
+	;;
+*)
+	echo "Status: 300 wat"
+	;;
+esac
+echo "Merf: merf"
+echo
+echo "james"
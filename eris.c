@@ -1,15 +1,18 @@
 /*
  * simple httpd to be started from tcpserver 
  */
+#define _GNU_SOURCE
 #define _FILE_OFFSET_BITS 64
 #include <stdlib.h>
 #include <unistd.h>
 #include <ctype.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <fcntl.h>
 #include <time.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
 #include <signal.h>
 #include <sys/wait.h>
@@ -17,20 +20,38 @@
 #include <errno.h>
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <poll.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <dirent.h>
 #include <limits.h>
+#include <netdb.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <spawn.h>
 
 #include "strings.h"
 #include "mime.h"
 #include "timerfc.h"
+#include "uring.h"
+#include "simd.h"
+#include "fcache.h"
+#include "dcache.h"
+#include "zcache.h"
+#include "backend.h"
+#include "logbuf.h"
+#include "stats.h"
 #include "version.h"
 
 #ifdef __linux__
 #include <sys/sendfile.h>
 #else
-#define sendfile(a, b, c, d) -1
+#define sendfile(a, b, c, d) (errno = ENOSYS, -1)
+#define splice(a, b, c, d, e, f) (errno = ENOSYS, -1)
 #endif
 
 #ifndef min
@@ -75,6 +96,18 @@
  */
 #define SENDFILE_TIMEOUT ((int)(SIZE_MAX / MIN_WRITE_RATE))
 
+/*
+ * When splicing, ask for a pipe this big
+ */
+#define SPLICE_PIPE_SIZE (1024 * 1024)
+
+/*
+ * When mapping, start with this much at a time, and go up to MMAP_CHUNK_MAX
+ * as long as the client keeps taking all of it
+ */
+#define MMAP_CHUNK_MIN (64 * 1024)
+#define MMAP_CHUNK_MAX (4 * 1024 * 1024)
+
 /*
  * Maximum size of a request header (the whole block) 
  */
@@ -90,118 +123,550 @@
  */
 #define MAXHEADERFIELDS 60
 
+/*
+ * Maximum number of ranges in one request; any more and we send the whole file
+ */
+#define MAXRANGES 16
+
 #define BUFFER_SIZE 8192
 
+/*
+ * When pipelined requests are waiting, responses pile up in the output
+ * buffer until it gets this big.  Bodies up to PIPELINE_BODY_MAX get
+ * copied in too; anything bigger goes out with sendfile.
+ */
+#define PIPELINE_MAX (64 * 1024)
+#define PIPELINE_BODY_MAX (16 * 1024)
+
+/*
+ * How many epoll events to handle per wakeup
+ */
+#define MAXEVENTS 256
+
+/*
+ * Stack size for -t threads
+ */
+#define THREAD_STACK_SIZE (256 * 1024)
+
+/*
+ * Submission queue size for the io_uring loop
+ */
+#define URING_ENTRIES 256
+
+/*
+ * Files up to this size get read into the output buffer by the ring,
+ * and go out in the same send as the header
+ */
+#define URING_READ_MAX (16 * 1024)
+
+/*
+ * Memory each worker may spend keeping small files' responses around
+ */
+#define SMALLFILE_MEMORY (64 * 1024 * 1024)
+
+/*
+ * Memory each worker may spend keeping directory listings around
+ */
+#define DIRLIST_MEMORY (32 * 1024 * 1024)
+
+/*
+ * An event loop reads directories up to this many entries itself.
+ * Bigger ones get listed by a child process, and aren't kept.
+ */
+#define DIRLIST_INLINE 256
+
 /*
  * Options
  */
 int doauth = 0;
 int docgi = 0;
+int dobackend = 0;
 int doidx = 0;
 int nochdir = 0;
 int redirect = 0;
 int portappend = 0;
+int logtimes = 0;
+int dostats = 0;
 char *connector = NULL;
+char *listen_addr = NULL;
+int nworkers = 4;
+int evmode = 0;
+int useuring = 0;
+int nthreads = 0;
+int fcache_size = 1024;
+off_t smallfile_max = 16 * 1024;
+char *zcache_dir = NULL;
+off_t zcache_max = 256 * 1024 * 1024;
 
 
 /*
- * Variables that persist between requests 
+ * Variables that persist between connections
  */
 int cwd;
-int keepalive = 0;
-char *remote_addr = NULL;
-char *remote_ident = NULL;
+int listen_fd = -1;
+
+/*
+ * Set in prefork workers, where finishing a connection must not exit
+ */
+int in_worker = 0;
 
 /*
- * Things that are really super convenient to have globally.
- * These could be put into a struct for a threading version
- * of eris.
+ * The request being handled on a connection.
+ * All of this is reset between requests.
  */
-enum { GET, POST, HEAD, CONNECT } method;
-char *host;
-char *user_agent;
-char *refer;
-char *path;
-int http_version;
-char *content_type;
-size_t content_length;
-off_t range_start, range_end;
-time_t ims;
+struct request {
+	enum { GET, POST, HEAD, CONNECT } method;
+	char *host;
+	char *user_agent;
+	char *refer;
+	char *path;
+	int http_version;
+	char *content_type;
+	size_t content_length;	/* chunked: what's left of this chunk */
+	int chunked;		/* Transfer-Encoding: chunked */
+	enum { CHUNK_SIZE, CHUNK_END, CHUNK_TRAILER, CHUNK_DONE, CHUNK_BAD } chunk;
+	char *range;
+	time_t ims;
+	char *if_none_match;
+	char *if_range;
+	int accept_encoding;	/* mask of encodings[] */
+	char *query_string;
+	char *path_info;
+	char fspath[PATH_MAX];
 
+	/*
+	 * Byte ranges being sent.  More than one makes a
+	 * multipart/byteranges response, which goes out a part at a time.
+	 */
+	struct {
+		off_t first, last;
+	} ranges[MAXRANGES];
+	int nranges;
+	int nextrange;
+	const char *range_type;
+	off_t range_size;
+	char boundary[40];
 
-#define BUFFER_SIZE 8192
+	/*
+	 * What dolog() said, for -L and -S once the response is out
+	 */
+	int logcode;
+	off_t loglen;
+	off_t sent;		/* bytes written to the client */
+	struct timespec start;	/* when the header block was all in */
+
+	/*
+	 * -S: when the request started, and when each phase of it finished
+	 */
+	uint64_t begin;
+	uint64_t stamps[STATS_PHASES];
+	int vhost;		/* stats_vhost() slot */
+
+	/*
+	 * Header fields, kept around for the CGI environment
+	 */
+	struct {
+		char *name;
+		char *val;
+	} fields[MAXHEADERFIELDS];
+	int nfields;
+};
 
+/*
+ * A client connection.
+ * Request strings point into in[], which only gets shuffled between requests.
+ */
+struct conn {
+	int rfd, wfd;
+	int keepalive;
+	int notsock;		/* wfd is a pipe or something: use write */
+	char *remote_addr;
+	char *remote_ident;
+
+	char in[MAXHEADERLEN + BUFFER_SIZE];
+	size_t inlen;		/* bytes in in[] */
+	size_t scan;		/* bytes of in[] already parsed */
+	size_t seen;		/* bytes of in[] already searched for a newline */
+	size_t reqlen;		/* bytes of in[] used by this request */
+	size_t hdrlen;		/* bytes of in[] in its header block */
+
+	char *out;
+	size_t outsize, outlen, outoff;
+
+	int file;		/* body being sent, or -1 */
+	off_t file_off, file_remain;
+	int sendmode;		/* how it goes out: SEND_* */
+	int pipe[2];		/* SEND_SPLICE only, or -1 */
+	size_t piped;		/* SEND_SPLICE only: bytes waiting in the pipe */
+	size_t chunk;		/* SEND_MMAP only: bytes to map next time */
+
+	time_t deadline;	/* event loop only */
+	uint32_t events;	/* event loop only */
+	int sending;		/* event loop only */
+	int detached;		/* handed off to a child process */
+
+	int root;		/* vhost directory, or -1 */
+	struct fentry *fe;	/* cache entry file belongs to, or NULL */
+	struct fentry *rootfe;	/* cache entry root belongs to, or NULL */
+	int cgi_in;		/* CGI output, or -1 */
+	int cgi_out;		/* CGI input, or -1 */
+	struct backend backend;	/* -b only: application server request */
+
+	int pending;		/* io_uring only: operations in flight */
+	int closing;		/* io_uring only: free when pending hits 0 */
+	int opening;		/* io_uring only: openat/statx in flight */
+	int openfd, open_err;	/* io_uring only: openat result */
+	int stat_err;		/* io_uring only: statx result */
+	struct statx stx;
+	sigjmp_buf jmp;
+
+	struct request r;
+};
+
+
+/*
+ * Write a log line to stderr, by way of the log buffer
+ */
+void
+log_request(struct conn *c, int code, off_t len)
+{
+	struct request *r = &c->r;
+	char line[MAXHEADERLEN + 256];
+	int n;
+
+	sanitize(r->host);
+	sanitize(r->user_agent);
+	sanitize(r->refer);
+
+	n = snprintf(line, sizeof line, "%s %d %lu %s %s %s %s", c->remote_addr, code, (unsigned long) len, r->host, r->user_agent, r->refer, r->path);
+	n = min(n, sizeof line - 40);
+	if (logtimes) {
+		struct timespec now;
+		long usec;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		usec = (now.tv_sec - r->start.tv_sec) * 1000000 + (now.tv_nsec - r->start.tv_nsec) / 1000;
+		n += snprintf(line + n, sizeof line - n, " %ld.%06ld %llu", usec / 1000000, usec % 1000000, (unsigned long long) r->sent);
+	}
+	line[n++] = '\n';
+	logbuf_write(line, n);
+}
 
 /** Log a request */
 void
-dolog(int code, off_t len)
-{				/* write a log line to stderr */
-	sanitize(host);
-	sanitize(user_agent);
-	sanitize(refer);
+dolog(struct conn *c, int code, off_t len)
+{
+	/*
+	 * Kept for finish_request(): with -L, the line waits for the response
+	 */
+	c->r.logcode = code;
+	c->r.loglen = len;
+	if (!logtimes) {
+		log_request(c, code, len);
+	}
+}
 
-	fprintf(stderr, "%s %d %lu %s %s %s %s\n", remote_addr, code, (unsigned long) len, host, user_agent, refer, path);
+/*
+ * Note when a phase of the request finished, the first time it does
+ */
+void
+stamp(struct conn *c, enum stats_phase phase)
+{
+	if (dostats && !c->r.stamps[phase]) {
+		c->r.stamps[phase] = stats_now();
+	}
 }
 
+/*
+ * The request is over: write out the log line dolog() held back, if any,
+ * and count how long it all took.
+ * A request handed off to a child process is the child's to finish.
+ */
 void
-header(unsigned int code, const char *httpcomment)
+finish_request(struct conn *c)
 {
-	printf("HTTP/1.%d %u %s\r\n", http_version, code, httpcomment);
-	printf("Server: %s\r\n", FNORD);
-	printf("Connection: %s\r\n", keepalive ? "keep-alive" : "close");
+	struct request *r = &c->r;
 
+	if (c->detached) {
+		return;
+	}
+	if (logtimes && r->logcode) {
+		log_request(c, r->logcode, r->loglen);
+	}
+	if (dostats && r->begin) {
+		stats_record(r->vhost, r->logcode, r->begin, r->stamps, stats_now());
+		r->begin = 0;
+	}
+	r->logcode = 0;
 }
 
+/*
+ * We're done with this request: bail out to whoever is driving the connection
+ */
 void
-eoh()
+done(struct conn *c)
 {
-	printf("\r\n");
+	siglongjmp(c->jmp, 1);
 }
 
 /*
- * output an error message and exit 
+ * Set a timeout for whatever we're about to wait on
  */
 void
-badrequest(long code, const char *httpcomment, const char *message)
+settimeout(struct conn *c, int secs)
 {
-	size_t msglen = 0;
+	if (evmode || nthreads) {
+		c->deadline = time(NULL) + secs;
+	} else {
+		alarm(secs);
+	}
+}
 
-	keepalive = 0;
-	header(code, httpcomment);
-	if (message) {
-		msglen = (strlen(message) * 2) + 15;
+/*
+ * Wait for fd to be ready, until the connection's deadline.
+ * Returns 0 when it's ready, or -1 if time ran out.
+ */
+int
+cwait(struct conn *c, int fd, short events)
+{
+	struct pollfd pfd;
+
+	pfd.fd = fd;
+	pfd.events = events;
+	while (1) {
+		time_t left = c->deadline - time(NULL);
 
-		printf("Content-Length: %lu\r\nContent-Type: text/html\r\n\r\n", (unsigned long) msglen);
-		printf("<title>%s</title>%s", message, message);
+		if (left <= 0) {
+			return -1;
+		}
+		switch (poll(&pfd, 1, left * 1000)) {
+		case 0:
+			return -1;
+		case 1:
+			return 0;
+		}
 	}
-	printf("\r\n");
-	fflush(stdout);
-	dolog(code, msglen);
+}
 
-	exit(0);
+/*
+ * The directory this request's paths are relative to
+ */
+int
+docroot(struct conn *c)
+{
+	return (c->root == -1) ? cwd : c->root;
+}
+
+/*
+ * Write out buffered output.
+ * Returns 1 when it's all gone, 0 if the client can't take any more
+ * right now (event loop only), and -1 on error.
+ */
+int
+oflush(struct conn *c)
+{
+	/*
+	 * If a body is coming, let the kernel hold the header back
+	 * so they can go out in the same packet.
+	 */
+	int flags = (c->file_remain > 0) ? MSG_MORE : 0;
+
+	while (c->outoff < c->outlen) {
+		ssize_t len;
+
+		if (c->notsock) {
+			len = write(c->wfd, c->out + c->outoff, c->outlen - c->outoff);
+		} else {
+			len = send(c->wfd, c->out + c->outoff, c->outlen - c->outoff, flags);
+			if ((-1 == len) && (errno == ENOTSOCK)) {
+				c->notsock = 1;
+				continue;
+			}
+		}
+
+		if (-1 == len) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN) {
+				if (evmode) {
+					return 0;
+				}
+				if (0 == cwait(c, c->wfd, POLLOUT)) {
+					continue;
+				}
+			}
+			c->outoff = c->outlen = 0;
+			c->keepalive = 0;
+			return -1;
+		}
+		c->outoff += len;
+		c->r.sent += len;
+	}
+	c->outoff = c->outlen = 0;
+
+	return 1;
+}
+
+/*
+ * Make room for len more bytes of output
+ */
+void
+ogrow(struct conn *c, size_t len)
+{
+	if (c->outlen + len > c->outsize) {
+		size_t size = c->outsize ? c->outsize : BUFFER_SIZE;
+
+		while (size < c->outlen + len) {
+			size *= 2;
+		}
+		c->out = realloc(c->out, size);
+		if (!c->out) {
+			fprintf(stderr, "Out of memory.  Dying.\n");
+			exit(1);
+		}
+		c->outsize = size;
+	}
+}
+
+void
+owrite(struct conn *c, const char *buf, size_t len)
+{
+	if ((c->outlen + len > c->outsize) && !evmode && c->outlen) {
+		/*
+		 * Blocking I/O can just write out what's there
+		 */
+		if (-1 == oflush(c)) {
+			done(c);
+		}
+	}
+	ogrow(c, len);
+	memcpy(c->out + c->outlen, buf, len);
+	c->outlen += len;
+}
+
+void
+oprintf(struct conn *c, const char *fmt, ...)
+{
+	char buf[BUFFER_SIZE];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof buf, fmt, ap);
+	va_end(ap);
+
+	if (len > 0) {
+		owrite(c, buf, min(len, (sizeof buf) - 1));
+	}
+}
+
+/*
+ * Response header builder.
+ * These go straight into the output buffer, without printf.
+ */
+
+void
+ostr(struct conn *c, const char *s)
+{
+	owrite(c, s, strlen(s));
+}
+
+void
+onum(struct conn *c, unsigned long long n)
+{
+	char buf[24];
+	char *p = buf + sizeof buf;
+
+	do {
+		*(--p) = '0' + (n % 10);
+		n /= 10;
+	} while (n);
+	owrite(c, p, buf + sizeof buf - p);
+}
+
+void
+ofield(struct conn *c, const char *name, const char *val)
+{
+	ostr(c, name);
+	owrite(c, ": ", 2);
+	ostr(c, val);
+	owrite(c, "\r\n", 2);
 }
 
 void
-env(const char *k, const char *v)
+ofieldnum(struct conn *c, const char *name, unsigned long long val)
 {
-	if (v) {
-		setenv(k, v, 1);
+	ostr(c, name);
+	owrite(c, ": ", 2);
+	onum(c, val);
+	owrite(c, "\r\n", 2);
+}
+
+void
+header(struct conn *c, unsigned int code, const char *httpcomment)
+{
+	char status[] = "HTTP/1.x ";
+
+	status[7] = '0' + c->r.http_version;
+	owrite(c, status, sizeof status - 1);
+	onum(c, code);
+	owrite(c, " ", 1);
+	ostr(c, httpcomment);
+	owrite(c, "\r\n", 2);
+	ofield(c, "Server", FNORD);
+	ofield(c, "Connection", c->keepalive ? "keep-alive" : "close");
+}
+
+void
+eoh(struct conn *c)
+{
+	owrite(c, "\r\n", 2);
+	stamp(c, STATS_HEADER);
+}
+
+/*
+ * output an error message and finish
+ */
+void
+badrequest(struct conn *c, long code, const char *httpcomment, const char *message)
+{
+	size_t msglen = 0;
+
+	c->keepalive = 0;
+	header(c, code, httpcomment);
+	if (message) {
+		msglen = (strlen(message) * 2) + 15;
+
+		ofieldnum(c, "Content-Length", msglen);
+		ofield(c, "Content-Type", "text/html");
+		eoh(c);
+		ostr(c, "<title>");
+		ostr(c, message);
+		ostr(c, "</title>");
+		ostr(c, message);
 	}
+	eoh(c);
+	dolog(c, code, msglen);
+
+	done(c);
 }
 
+extern char **environ;
+
 
 void
-not_found()
+not_found(struct conn *c)
 {
 	char msg[] = "The requested URL does not exist here.";
 
-	header(404, "Not Found");
-	printf("Content-Type: text/html\r\n");
-	printf("Content-Length: %lu\r\n", (unsigned long) sizeof msg);
-	printf("\r\n");
-	printf("%s\n", msg);	/* sizeof msg includes the NULL */
-	dolog(404, sizeof msg);
-	fflush(stdout);
+	header(c, 404, "Not Found");
+	ofield(c, "Content-Type", "text/html");
+	ofieldnum(c, "Content-Length", sizeof msg);
+	eoh(c);
+	ostr(c, msg);
+	owrite(c, "\n", 1);	/* sizeof msg includes the NULL */
+	dolog(c, 404, sizeof msg);
 }
 
 char *
@@ -214,7 +679,7 @@ proto_getenv(char *proto, char *name)
 }
 
 void
-get_ucspi_env()
+get_ucspi_env(struct conn *c)
 {
 	char *ucspi = getenv("PROTO");
 	char *ip = NULL;
@@ -227,14 +692,14 @@ get_ucspi_env()
 		 * Busybox, as usual, has the right idea 
 		 */
 		if ((p = proto_getenv(ucspi, "REMOTEADDR"))) {
-			remote_addr = strdup(p);
+			c->remote_addr = strdup(p);
 		} else {
 			ip = proto_getenv(ucspi, "REMOTEIP");
 			port = proto_getenv(ucspi, "REMOTEPORT");
 		}
 
 		if ((p = proto_getenv(ucspi, "REMOTEINFO"))) {
-			remote_ident = strdup(p);
+			c->remote_ident = strdup(p);
 		}
 	}
 
@@ -248,7 +713,7 @@ get_ucspi_env()
 		char buf[80];
 
 		snprintf(buf, sizeof buf, "%s:%s", ip, port);
-		remote_addr = strdup(buf);
+		c->remote_addr = strdup(buf);
 	}
 }
 
@@ -257,7 +722,7 @@ parse_options(int argc, char *argv[])
 {
 	int opt;
 
-	while (-1 != (opt = getopt(argc, argv, "acdhkpro:v."))) {
+	while (-1 != (opt = getopt(argc, argv, "acdehkpruLSo:l:m:w:t:f:s:z:Z:b:v."))) {
 		switch (opt) {
 		case 'a':
 			doauth = 1;
@@ -268,6 +733,13 @@ parse_options(int argc, char *argv[])
 		case 'd':
 			doidx = 1;
 			break;
+		case 'e':
+			evmode = 1;
+			break;
+		case 'u':
+			evmode = 1;
+			useuring = 1;
+			break;
 		case '.':
 			nochdir = 1;
 			break;
@@ -277,9 +749,59 @@ parse_options(int argc, char *argv[])
 		case 'r':
 			redirect = 1;
 			break;
+		case 'L':
+			logtimes = 1;
+			break;
+		case 'S':
+			dostats = 1;
+			break;
 		case 'o':
 			connector = optarg;
 			break;
+		case 'l':
+			listen_addr = optarg;
+			break;
+		case 'm':
+			if (mime_load(optarg)) {
+				fprintf(stderr, "%s: %s\n", optarg, strerror(errno));
+				exit(69);
+			}
+			break;
+		case 'w':
+			nworkers = atoi(optarg);
+			if (nworkers < 1) {
+				nworkers = 1;
+			}
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			if (nthreads < 1) {
+				nthreads = 1;
+			}
+			break;
+		case 'f':
+			fcache_size = atoi(optarg);
+			if (fcache_size < 0) {
+				fcache_size = 0;
+			}
+			break;
+		case 's':
+			smallfile_max = atoll(optarg);
+			break;
+		case 'z':
+			zcache_dir = optarg;
+			break;
+		case 'Z':
+			zcache_max = atoll(optarg);
+			break;
+		case 'b':
+			if (backend_init(optarg, CGI_TIMEOUT)) {
+				fprintf(stderr, "%s: %s\n", optarg, strerror(errno));
+				exit(69);
+			}
+			docgi = 1;
+			dobackend = 1;
+			break;
 		case 'v':
 			printf("%s\n", FNORD);
 			exit(0);
@@ -295,824 +817,3947 @@ parse_options(int argc, char *argv[])
 			fprintf(stderr, "-p           Append port to hostname directory\n");
 			fprintf(stderr, "-r           Enable symlink redirection\n");
 			fprintf(stderr, "-o HANDLER   Path to HTTP CONNECT handler\n");
+			fprintf(stderr, "-m FILE      Load MIME types from FILE (e.g. /etc/mime.types)\n");
+			fprintf(stderr, "-l ADDR:PORT Listen on ADDR:PORT instead of using stdin\n");
+			fprintf(stderr, "-w WORKERS   Number of listener worker processes (default 4)\n");
+			fprintf(stderr, "-e           Run an event loop in each listener worker\n");
+			fprintf(stderr, "-u           Like -e, but drive the event loop with io_uring\n");
+			fprintf(stderr, "-t THREADS   Serve connections from THREADS threads in each worker\n");
+			fprintf(stderr, "-f FILES     Keep up to FILES files open in each worker (default 1024)\n");
+			fprintf(stderr, "-s BYTES     Keep whole responses for files up to BYTES (default 16384)\n");
+			fprintf(stderr, "-z DIR       Gzip text files as they're asked for, and keep them in DIR\n");
+			fprintf(stderr, "-Z BYTES     Keep up to BYTES in the -z directory (default 256MiB)\n");
+			fprintf(stderr, "-b fcgi:SOCK Hand CGI requests to a FastCGI server on Unix socket SOCK\n");
+			fprintf(stderr, "-b scgi:SOCK Or to an SCGI server\n");
+			fprintf(stderr, "-L           Log how long each request took, and bytes sent\n");
+			fprintf(stderr, "-S           Time each phase of requests, for /.well-known/eris-status and SIGUSR1\n");
 			fprintf(stderr, "-v           Print version and exit\n");
 			exit(69);
 		}
 	}
+	if ((evmode || nthreads || dostats) && !listen_addr) {
+		fprintf(stderr, "-e, -u, -t, and -S only make sense with -l\n");
+		exit(69);
+	}
+	if (evmode && nthreads) {
+		fprintf(stderr, "Pick one of -t or an event loop\n");
+		exit(69);
+	}
+	if (evmode && dobackend) {
+		/*
+		 * Backend sockets block, so an event loop would fork
+		 * for every request and never get to reuse one
+		 */
+		fprintf(stderr, "-b doesn't work with an event loop: use -t\n");
+		exit(69);
+	}
 }
 
 /*
- * CGI stuff
+ * Close our ends of the CGI pipes
  */
-static void
-sigchld(int sig)
+void
+cgi_close(struct conn *c)
 {
-	while (waitpid(0, NULL, WNOHANG) > 0);
+	if (c->cgi_in != -1) {
+		close(c->cgi_in);
+		c->cgi_in = -1;
+	}
+	if (c->cgi_out != -1) {
+		close(c->cgi_out);
+		c->cgi_out = -1;
+	}
 }
 
-static void
-sigalarm_cgi(int sig)
+/*
+ * Done with the file being sent, which might be the cache's
+ */
+void
+file_close(struct conn *c)
 {
-	/*
-	 * send this out regardless of whether we've already sent a header, to maybe help with debugging 
-	 */
-	badrequest(504, "Gateway Timeout", "The CGI is being too slow.");
+	if (c->fe) {
+		fcache_release(c->fe);
+		c->fe = NULL;
+	} else if (c->file != -1) {
+		close(c->file);
+	}
+	c->file = -1;
 }
 
-static void
-cgi_child(const char *relpath)
-{
-	env("GATEWAY_INTERFACE", "CGI/1.1");
-	env("SERVER_SOFTWARE", FNORD);
-	env("REQUEST_URI", path);
-	env("SERVER_NAME", host);
-	env("SCRIPT_NAME", relpath);
-	env("REMOTE_ADDR", remote_addr);
-	env("REMOTE_IDENT", remote_ident);
-	if (content_length) {
-		char cl[20];
-
-		snprintf(cl, sizeof cl, "%llu", (unsigned long long) content_length);
-		env("CONTENT_LENGTH", cl);
-		env("CONTENT_TYPE", content_type);
+void
+root_close(struct conn *c)
+{
+	if (c->rootfe) {
+		fcache_release(c->rootfe);
+		c->rootfe = NULL;
+	} else if (c->root != -1) {
+		close(c->root);
 	}
+	c->root = -1;
+}
 
-	/*
-	 * Try to change to CGI's directory 
-	 */
-	{
-		char *delim = strrchr(relpath, '/');
+/*
+ * Event loop state, needed here so detached children can clean up
+ */
+int epfd = -1;
+struct conn **conns = NULL;
+int maxconns = 0;
+int maxfd = 0;
+struct uring ring;
 
-		if (delim) {
-			*delim = '\0';
-			if (0 == chdir(relpath)) {
-				relpath = delim + 1;
-			}
+/*
+ * Let go of everything a connection holds except its buffers
+ */
+void
+conn_release(struct conn *c)
+{
+	finish_request(c);
+	if (evmode) {
+		if (!useuring) {
+			epoll_ctl(epfd, EPOLL_CTL_DEL, c->rfd, NULL);
 		}
+		conns[c->rfd] = NULL;
+	}
+	file_close(c);
+	root_close(c);
+	close(c->rfd);
+	if (c->wfd != c->rfd) {
+		close(c->wfd);
 	}
+	cgi_close(c);
+	backend_close(&c->backend);
+	if (c->pipe[0] != -1) {
+		close(c->pipe[0]);
+		close(c->pipe[1]);
+		c->pipe[0] = c->pipe[1] = -1;
+	}
+	free(c->remote_addr);
+	free(c->remote_ident);
+	free(c->r.path_info);
+}
 
-	execl(relpath, relpath, NULL);
-	exit(1);
+void
+conn_close(struct conn *c)
+{
+	conn_release(c);
+	free(c->out);
+	free(c);
 }
 
+/*
+ * Hand the connection off to a child process, for things that block.
+ *
+ * This only returns in the child, which finishes the request
+ * with blocking I/O and exits.
+ */
 void
-cgi_parent(int cin, int cout, int passthru)
+detach(struct conn *c)
 {
-	char cgiheader[BUFFER_SIZE];
-	size_t cgiheaderlen = 0;
-	FILE *cinf = fdopen(cin, "rb");
-	size_t size = 0;
-	int header_sent = 0;
-	int code = 200;
+	pid_t pid;
+	int fd;
 
-	fcntl(cin, F_SETFL, O_NONBLOCK);
-	signal(SIGCHLD, sigchld);
-	signal(SIGPIPE, SIG_IGN);	/* NO! no signal! */
-	signal(SIGALRM, sigalarm_cgi);
+	if (!evmode) {
+		return;
+	}
 
-	while (1) {
-		int nfds;
-		fd_set rfds, wfds;
+	c->keepalive = 0;
+	pid = fork();
+	if (-1 == pid) {
+		badrequest(c, 500, "Internal Server Error", "Unable to fork.");
+	}
+	if (pid) {
+		c->detached = 1;
+		done(c);
+	}
 
-		FD_ZERO(&rfds);
-		FD_ZERO(&wfds);
-		FD_SET(cin, &rfds);
-		nfds = cin;
+	evmode = 0;
+	in_worker = 0;
+	fcache_forked();
+	dcache_forked();
+	logbuf_forked();
+	backend_forked();
+	for (fd = 0; fd <= maxfd; fd += 1) {
+		struct conn *o = conns[fd];
 
-		if (content_length) {
+		if (o && (o != c)) {
 			/*
-			 * have post data 
+			 * Cached ones might be ours too
 			 */
-			FD_SET(cout, &wfds);
-			if (cout > nfds) {
-				nfds = cout;
+			if ((o->file != -1) && !o->fe) {
+				close(o->file);
+			}
+			if ((o->root != -1) && !o->rootfe) {
+				close(o->root);
 			}
-		} else if (cout >= 0) {
-			close(cout);	/* no post data */
-			cout = -1;
+			close(fd);
 		}
-
-		alarm(CGI_TIMEOUT);
-		if (-1 == select(nfds + 1, &rfds, &wfds, NULL, NULL)) {
-			break;
+	}
+	if (useuring) {
+		close(ring.fd);
+		useuring = 0;
+	} else {
+		close(epfd);
+	}
+	close(listen_fd);
+	fcntl(c->rfd, F_SETFL, fcntl(c->rfd, F_GETFL) & ~O_NONBLOCK);
+}
+
+/*
+ * CGI stuff
+ */
+static void
+sigchld(int sig)
+{
+	while (waitpid(0, NULL, WNOHANG) > 0);
+}
+
+/*
+ * Hand each CGI variable for the request to fn.
+ * Ones without a value are left out.
+ */
+void
+cgi_vars(struct conn *c, const char *relpath, void (*fn)(void *arg, const char *name, const char *val), void *arg)
+{
+	struct request *r = &c->r;
+	const struct {
+		const char *name;
+		const char *val;
+	} vars[] = {
+		{"GATEWAY_INTERFACE", "CGI/1.1"},
+		{"SERVER_SOFTWARE", FNORD},
+		{"SERVER_PROTOCOL", r->http_version ? "HTTP/1.1" : "HTTP/1.0"},
+		{"REQUEST_METHOD", (r->method == POST) ? "POST" : (r->method == HEAD) ? "HEAD" : "GET"},
+		{"REQUEST_URI", r->path},
+		{"QUERY_STRING", r->query_string},
+		{"PATH_INFO", r->path_info},
+		{"SERVER_NAME", r->host},
+		{"SCRIPT_NAME", relpath},
+		{"REMOTE_ADDR", c->remote_addr},
+		{"REMOTE_IDENT", c->remote_ident},
+	};
+	int i;
+
+	for (i = 0; i < r->nfields; i += 1) {
+		char name[BUFFER_SIZE];
+
+		snprintf(name, sizeof name, "HTTP_%s", r->fields[i].name);
+		fn(arg, name, r->fields[i].val);
+	}
+	for (i = 0; i < sizeof vars / sizeof *vars; i += 1) {
+		if (vars[i].val) {
+			fn(arg, vars[i].name, vars[i].val);
+		}
+	}
+	if (r->content_length) {
+		char cl[20];
+
+		snprintf(cl, sizeof cl, "%llu", (unsigned long long) r->content_length);
+		fn(arg, "CONTENT_LENGTH", cl);
+	}
+	if ((r->content_length || r->chunked) && r->content_type) {
+		/*
+		 * A chunked body has no CONTENT_LENGTH: it ends at EOF,
+		 * and HTTP_TRANSFER_ENCODING says so.
+		 */
+		fn(arg, "CONTENT_TYPE", r->content_type);
+	}
+}
+
+/*
+ * A CGI's environment, put together in one block
+ */
+struct cgienv {
+	char **envp;
+	size_t n;
+	char *p;		/* where the next string goes */
+	size_t size;		/* bytes of strings */
+};
+
+static void
+env_size(void *arg, const char *name, const char *val)
+{
+	struct cgienv *e = arg;
+
+	e->n += 1;
+	e->size += strlen(name) + strlen(val) + 2;
+}
+
+static void
+env_add(void *arg, const char *name, const char *val)
+{
+	struct cgienv *e = arg;
+
+	e->envp[e->n++] = e->p;
+	e->p = stpcpy(stpcpy(stpcpy(e->p, name), "="), val) + 1;
+}
+
+/*
+ * Is var's name already in envp?
+ */
+static int
+env_has(char **envp, size_t n, const char *var)
+{
+	size_t len = strcspn(var, "=");
+	size_t i;
+
+	for (i = 0; i < n; i += 1) {
+		if (!strncmp(envp[i], var, len) && (envp[i][len] == '=')) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * The CGI's variables, then whatever of ours they don't replace.
+ * Ours is never touched.  Free the result when the CGI is running.
+ */
+char **
+cgi_env(struct conn *c, const char *relpath)
+{
+	struct cgienv e = { 0 };
+	size_t nenv, i;
+
+	cgi_vars(c, relpath, env_size, &e);
+	for (nenv = 0; environ[nenv]; nenv += 1);
+
+	e.envp = malloc((e.n + nenv + 1) * sizeof *e.envp + e.size);
+	if (!e.envp) {
+		return NULL;
+	}
+	e.p = (char *) (e.envp + e.n + nenv + 1);
+	e.n = 0;
+	cgi_vars(c, relpath, env_add, &e);
+
+	for (i = 0; i < nenv; i += 1) {
+		if (!env_has(e.envp, e.n, environ[i])) {
+			e.envp[e.n++] = environ[i];
+		}
+	}
+	e.envp[e.n] = NULL;
+	return e.envp;
+}
+
+/*
+ * Start the CGI in its own directory, with in and out as stdin and stdout.
+ *
+ * posix_spawn doesn't copy our page tables the way fork does,
+ * which matters once a worker has a lot mapped.
+ */
+pid_t
+cgi_spawn(struct conn *c, const char *relpath, int in, int out)
+{
+	posix_spawn_file_actions_t fa;
+	posix_spawnattr_t attr;
+	sigset_t none, all;
+	const char *delim = strrchr(relpath, '/');
+	char *argv[2];
+	char **envp;
+	pid_t pid;
+	int err;
+
+	if (!(envp = cgi_env(c, relpath))) {
+		return -1;
+	}
+
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_adddup2(&fa, in, 0);
+	posix_spawn_file_actions_adddup2(&fa, out, 1);
+	posix_spawn_file_actions_addfchdir_np(&fa, docroot(c));
+	if (delim) {
+		char dir[PATH_MAX];
+
+		snprintf(dir, sizeof dir, "%.*s", (int) (delim - relpath), relpath);
+		posix_spawn_file_actions_addchdir_np(&fa, dir);
+		relpath = delim + 1;
+	}
+
+	/*
+	 * Nothing blocked, nothing ignored, no handlers of ours
+	 */
+	sigemptyset(&none);
+	sigfillset(&all);
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+	posix_spawnattr_setsigmask(&attr, &none);
+	posix_spawnattr_setsigdefault(&attr, &all);
+
+	argv[0] = (char *) relpath;
+	argv[1] = NULL;
+	err = posix_spawn(&pid, relpath, &fa, &attr, argv, envp);
+
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&fa);
+	free(envp);
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	return pid;
+}
+
+/*
+ * Get more of a chunked request body into in[], after the header block.
+ * Whatever's been used up already makes room.
+ */
+ssize_t
+read_more(struct conn *c)
+{
+	memmove(c->in + c->hdrlen, c->in + c->reqlen, c->inlen - c->reqlen);
+	c->inlen -= c->reqlen - c->hdrlen;
+	c->reqlen = c->hdrlen;
+	if (c->inlen == sizeof c->in) {
+		/*
+		 * That's an awfully long chunk-size line
+		 */
+		errno = E2BIG;
+		return -1;
+	}
+	while (1) {
+		ssize_t ret = read(c->rfd, c->in + c->inlen, sizeof c->in - c->inlen);
+
+		if ((-1 == ret) && (errno == EAGAIN) && (0 == cwait(c, c->rfd, POLLIN))) {
+			continue;
+		}
+		if (ret > 0) {
+			c->inlen += ret;
+		}
+		return ret;
+	}
+}
+
+/*
+ * Work through chunked body framing in in[], as far as it goes,
+ * leaving r->content_length at what's left of the current chunk.
+ *
+ * Returns 1 partway through a chunk, 0 when there's no more body
+ * (or no more sense in it), or -1 if it needs more from read_more().
+ */
+int
+chunk_frame(struct conn *c)
+{
+	struct request *r = &c->r;
+
+	while (!r->content_length) {
+		char *line = c->in + c->reqlen;
+		char *nl, *end = line;
+		unsigned long long size;
+
+		if ((r->chunk == CHUNK_DONE) || (r->chunk == CHUNK_BAD)) {
+			return 0;
+		}
+		nl = memchr(line, '\n', c->inlen - c->reqlen);
+		if (!nl) {
+			return -1;
+		}
+		c->reqlen = nl - c->in + 1;
+
+		switch (r->chunk) {
+		case CHUNK_SIZE:
+			/*
+			 * hex size, maybe followed by extensions we ignore
+			 */
+			errno = 0;
+			size = isxdigit((unsigned char) *line) ? strtoull(line, &end, 16) : 0;
+			if ((end == line) || errno || !strchr(";\r\n \t", *end)) {
+				r->chunk = CHUNK_BAD;
+			} else if (size) {
+				r->content_length = size;
+				r->chunk = CHUNK_END;
+			} else {
+				r->chunk = CHUNK_TRAILER;
+			}
+			break;
+		case CHUNK_END:
+			r->chunk = ((nl == line) || ((nl == line + 1) && (*line == '\r'))) ? CHUNK_SIZE : CHUNK_BAD;
+			break;
+		case CHUNK_TRAILER:
+			/*
+			 * Trailer fields go nowhere: the CGI has its environment already
+			 */
+			if ((nl == line) || ((nl == line + 1) && (*line == '\r'))) {
+				r->chunk = CHUNK_DONE;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Read some of the request body, starting with whatever's already buffered.
+ * Chunked bodies come out decoded.
+ *
+ * Returns 0 at the end of the body.
+ */
+ssize_t
+read_body(struct conn *c, char *buf, size_t len)
+{
+	struct request *r = &c->r;
+	size_t avail;
+	ssize_t ret;
+
+	while (r->chunked && !r->content_length) {
+		ret = chunk_frame(c);
+		if (ret > -1) {
+			break;
+		}
+		if (read_more(c) < 1) {
+			r->chunk = CHUNK_BAD;
+			return -1;
+		}
+	}
+	if (r->chunk == CHUNK_BAD) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	len = min(len, r->content_length);
+	avail = c->inlen - c->reqlen;
+	if (!len) {
+		return 0;
+	} else if (avail) {
+		len = min(len, avail);
+		memcpy(buf, c->in + c->reqlen, len);
+		c->reqlen += len;
+		r->content_length -= len;
+		return len;
+	}
+	while (1) {
+		ret = read(c->rfd, buf, len);
+
+		if ((-1 == ret) && (errno == EAGAIN) && (0 == cwait(c, c->rfd, POLLIN))) {
+			continue;
+		}
+		if (ret > 0) {
+			r->content_length -= ret;
+		}
+		return ret;
+	}
+}
+
+/*
+ * A CGI's output, as it arrives in pieces.
+ *
+ * The header block is held back until it's over, since what it says
+ * decides how the body goes out: with the CGI's Content-Length,
+ * chunked, or to the end of the connection.
+ */
+struct cgiout {
+	char line[BUFFER_SIZE];	/* header field being put together */
+	size_t linelen;
+	char head[MAXHEADERLEN];	/* header fields to pass along */
+	size_t headlen;
+	int code;
+	char reason[80];
+	int status;		/* CGI sent Status */
+	int redirect;		/* CGI sent Location */
+	long long length;	/* CGI sent Content-Length, or -1 */
+	int chunked;		/* body goes out in chunks */
+	int nobody;		/* body gets thrown away */
+	int nosplice;		/* splice won't work for the body */
+	int passthru;		/* header block is over */
+	size_t size;		/* body bytes passed along */
+};
+
+void
+cgi_output_init(struct cgiout *o)
+{
+	memset(o, 0, sizeof *o);
+	o->code = 200;
+	strcpy(o->reason, "OK");
+	o->length = -1;
+}
+
+/*
+ * Take in one field from a CGI's header block
+ */
+void
+cgi_field(struct conn *c, struct cgiout *o, char *name, char *val)
+{
+	int len;
+
+	if (!strcasecmp(name, "Status")) {
+		char *txt = NULL;
+		int code = 0;
+
+		if (val) {
+			code = (int) strtol(val, &txt, 10);
+		}
+		if (code < 100) {
+			char msg[60];
+
+			snprintf(msg, sizeof msg, "CGI returned Status: %d", code);
+			badrequest(c, 500, "Internal Error", msg);
+		}
+		for (; *txt == ' '; txt += 1);
+		snprintf(o->reason, sizeof o->reason, "%s", txt);
+		o->code = code;
+		o->status = 1;
+		return;
+	}
+	if (!val || !strcasecmp(name, "Connection")) {
+		/*
+		 * That's our business
+		 */
+		return;
+	}
+	if (!strcasecmp(name, "Location")) {
+		o->redirect = 1;
+		if (!o->status) {
+			o->code = 302;
+			strcpy(o->reason, "CGI Redirect");
+		}
+	} else if (!strcasecmp(name, "Content-Length")) {
+		o->length = strtoll(val, NULL, 10);
+	}
+
+	len = snprintf(o->head + o->headlen, sizeof o->head - o->headlen, "%s: %s\r\n", name, val);
+	if (len >= sizeof o->head - o->headlen) {
+		badrequest(c, 500, "CGI Error", "CGI header block too big");
+	}
+	o->headlen += len;
+}
+
+/*
+ * The header block is over: send ours
+ */
+void
+cgi_head(struct conn *c, struct cgiout *o)
+{
+	if ((c->r.method == HEAD) || (o->code == 204) || (o->code == 304)) {
+		o->nobody = 1;
+	} else if (-1 == o->length) {
+		if (c->r.http_version && c->keepalive) {
+			o->chunked = 1;
+		} else {
+			c->keepalive = 0;
+		}
+	}
+	stamp(c, STATS_CGI);
+	header(c, o->code, o->reason);
+	if (!o->status && !o->redirect) {
+		ostr(c, "Pragma: no-cache\r\n");
+	}
+	owrite(c, o->head, o->headlen);
+	if (o->chunked) {
+		ofield(c, "Transfer-Encoding", "chunked");
+	}
+	eoh(c);
+	o->passthru = 1;
+}
+
+/*
+ * Pass along some of a CGI's output.
+ * Header fields get sorted out a line at a time.
+ */
+void
+cgi_output(struct conn *c, struct cgiout *o, const char *buf, size_t len)
+{
+	while (len && !o->passthru) {
+		const char *nl = memchr(buf, '\n', len);
+		size_t n = nl ? (nl - buf + 1) : len;
+		char *val;
+
+		if (o->linelen + n >= sizeof o->line) {
+			badrequest(c, 500, "CGI Error", "CGI output too weird");
+		}
+		memcpy(o->line + o->linelen, buf, n);
+		o->linelen += n;
+		o->line[o->linelen] = 0;
+		buf += n;
+		len -= n;
+		if (!nl) {
+			break;
+		}
+
+		if (!extract_header_field(o->line, &val, 0)) {
+			cgi_head(c, o);
+		} else {
+			cgi_field(c, o, o->line, val);
+		}
+		o->linelen = 0;
+	}
+	if (len && !o->nobody) {
+		if (o->chunked) {
+			char size[20];
+
+			owrite(c, size, snprintf(size, sizeof size, "%zx\r\n", len));
+			owrite(c, buf, len);
+			owrite(c, "\r\n", 2);
+		} else {
+			owrite(c, buf, len);
+		}
+		o->size += len;
+	}
+}
+
+/*
+ * The CGI is finished.  Returns the status code, for the log.
+ */
+int
+cgi_output_end(struct conn *c, struct cgiout *o)
+{
+	if (!o->passthru) {
+		if (o->linelen) {
+			char *val;
+
+			o->line[o->linelen] = 0;
+			if (extract_header_field(o->line, &val, 0)) {
+				cgi_field(c, o, o->line, val);
+			}
+		}
+		if (!o->headlen && !o->status) {
+			badrequest(c, 500, "CGI Error", "CGI output too weird");
+		}
+		cgi_head(c, o);
+	}
+	if (o->chunked) {
+		ostr(c, "0\r\n\r\n");
+	} else if (!o->nobody && (o->length != -1) && (o->size != o->length)) {
+		/*
+		 * The client can't tell where this response ends
+		 */
+		c->keepalive = 0;
+	}
+	return o->code;
+}
+
+int unsupported(int err);
+
+/*
+ * Move len bytes of CGI output, already waiting in the pipe,
+ * straight to the client without copying them through here.
+ */
+int
+cgi_splice(struct conn *c, struct cgiout *o, int fd, size_t len)
+{
+	if (o->chunked) {
+		oprintf(c, "%zx\r\n", len);
+	}
+	if (-1 == oflush(c)) {
+		return -1;
+	}
+	while (len) {
+		ssize_t n = -1;
+
+		if (!o->nosplice) {
+			/*
+			 * No SPLICE_F_NONBLOCK: whether this blocks is up to wfd
+			 */
+			n = splice(fd, NULL, c->wfd, NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (-1 == n) {
+				if (errno == EINTR) {
+					continue;
+				}
+				if ((errno == EAGAIN) && (0 == cwait(c, c->wfd, POLLOUT))) {
+					continue;
+				}
+				if (!unsupported(errno)) {
+					return -1;
+				}
+				o->nosplice = 1;
+			} else {
+				c->r.sent += n;
+			}
+		}
+		if (o->nosplice) {
+			char buf[BUFFER_SIZE];
+
+			n = read(fd, buf, min(len, sizeof buf));
+			if (n < 1) {
+				return -1;
+			}
+			owrite(c, buf, n);
+		}
+		len -= n;
+		o->size += n;
+	}
+	if (o->chunked) {
+		owrite(c, "\r\n", 2);
+	}
+	return 0;
+}
+
+/*
+ * A request body on its way to a CGI
+ */
+struct cgiin {
+	const char *pend;	/* taken from the client, not yet written */
+	size_t pendlen;
+	int full;		/* the CGI's stdin was full last time */
+	int nosplice;		/* splice won't work from rfd */
+	char buf[BUFFER_SIZE];
+};
+
+/*
+ * Move some of the request body along to the CGI's stdin,
+ * with splice if the client connection allows it.
+ * Returns -1 if that's as far as it's going to get.
+ */
+int
+cgi_input(struct conn *c, struct cgiin *in, int cout)
+{
+	struct request *r = &c->r;
+	ssize_t n;
+
+	if (r->chunked && !r->content_length && !in->pendlen) {
+		/*
+		 * Between chunks: chunk_frame() wants more of the framing
+		 */
+		return (read_more(c) > 0) ? 0 : -1;
+	}
+	if (in->full) {
+		/*
+		 * There's room again
+		 */
+		in->full = 0;
+		return 0;
+	}
+	if (in->pendlen) {
+		n = write(cout, in->pend, in->pendlen);
+		if (-1 == n) {
+			return ((errno == EAGAIN) || (errno == EINTR)) ? 0 : -1;
+		}
+		in->pend += n;
+		in->pendlen -= n;
+		return 0;
+	}
+
+	if (!in->nosplice) {
+		n = splice(c->rfd, NULL, cout, NULL, r->content_length, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (n > 0) {
+			r->content_length -= n;
+			return 0;
+		}
+		if (0 == n) {
+			return -1;
+		}
+		if (errno == EAGAIN) {
+			in->full = 1;
+			return 0;
+		}
+		if (errno == EINTR) {
+			return 0;
+		}
+		if (!unsupported(errno)) {
+			return -1;
+		}
+		in->nosplice = 1;
+	}
+
+	n = read(c->rfd, in->buf, min(sizeof in->buf, r->content_length));
+	if (-1 == n) {
+		return ((errno == EAGAIN) || (errno == EINTR)) ? 0 : -1;
+	}
+	if (0 == n) {
+		return -1;
+	}
+	in->pend = in->buf;
+	in->pendlen = n;
+	r->content_length -= n;
+	return 0;
+}
+
+/*
+ * Feed the CGI its input and pass along its output, both at once
+ */
+void
+cgi_parent(struct conn *c, int cin, int cout)
+{
+	struct request *r = &c->r;
+	struct cgiout o;
+	struct cgiin in;
+	char buf[BUFFER_SIZE];
+
+	cgi_output_init(&o);
+	memset(&in, 0, sizeof in);
+	c->cgi_in = cin;
+	c->cgi_out = cout;
+	fcntl(cout, F_SETFL, O_NONBLOCK);
+	signal(SIGCHLD, sigchld);
+	signal(SIGPIPE, SIG_IGN);	/* NO! no signal! */
+
+	while (1) {
+		struct pollfd fds[2];
+		int nfds = 1;
+		int ret;
+
+		fds[0].fd = cin;
+		fds[0].events = POLLIN;
+		fds[0].revents = 0;
+		fds[1].revents = 0;
+
+		if (cout != -1) {
+			int more = 0;
+
+			if (r->chunked && !in.pendlen && !r->content_length) {
+				more = (-1 == chunk_frame(c));
+			}
+
+			/*
+			 * Whatever came in with the header goes first
+			 */
+			if (!in.pendlen && r->content_length && (c->reqlen < c->inlen)) {
+				in.pend = c->in + c->reqlen;
+				in.pendlen = min(c->inlen - c->reqlen, r->content_length);
+				c->reqlen += in.pendlen;
+				r->content_length -= in.pendlen;
+			}
+			if (in.pendlen || in.full) {
+				fds[1].fd = cout;
+				fds[1].events = POLLOUT;
+				nfds = 2;
+			} else if (r->content_length || more) {
+				fds[1].fd = c->rfd;
+				fds[1].events = POLLIN;
+				nfds = 2;
+			} else {
+				close(cout);	/* that's all the post data */
+				cout = c->cgi_out = -1;
+			}
+		}
+
+		/*
+		 * poll times out the CGI.  This covers writing to the client,
+		 * and runs a little longer so the CGI gets its 504.
+		 */
+		settimeout(c, CGI_TIMEOUT + WRITETIMEOUT);
+		ret = poll(fds, nfds, CGI_TIMEOUT * 1000);
+		if (0 == ret) {
+			/*
+			 * send this out regardless of whether we've already sent a header, to maybe help with debugging 
+			 */
+			badrequest(c, 504, "Gateway Timeout", "The CGI is being too slow.");
+		}
+		if (-1 == ret) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+
+		if (fds[0].revents) {
+			ssize_t len;
+			int avail;
+
+			/*
+			 * Once the header block is out of the way,
+			 * the body can go through without us looking at it
+			 */
+			if (o.passthru && !o.nobody && !o.nosplice &&
+			    !ioctl(cin, FIONREAD, &avail) && (avail > 0)) {
+				if (cgi_splice(c, &o, cin, avail)) {
+					c->keepalive = 0;
+					break;
+				}
+				continue;
+			}
+
+			len = read(cin, buf, sizeof buf);
+
+			if (-1 == len) {
+				if ((errno == EAGAIN) || (errno == EINTR)) {
+					continue;
+				}
+				break;
+			}
+			if (0 == len) {
+				/*
+				 * CGI is done 
+				 */
+				break;
+			}
+			cgi_output(c, &o, buf, len);
+
+			/*
+			 * Naively assume the CGI knows best about sending stuff 
+			 */
+			if (o.passthru && (-1 == oflush(c))) {
+				break;
+			}
+		}
+		if (fds[1].revents && (-1 == cgi_input(c, &in, cout))) {
+			/*
+			 * The CGI stopped reading, or the client stopped sending
+			 */
+			close(cout);
+			cout = c->cgi_out = -1;
+		}
+	}
+
+	if (r->content_length || in.pendlen || (r->chunked && (r->chunk != CHUNK_DONE))) {
+		/*
+		 * The rest of the body is still coming
+		 */
+		c->keepalive = 0;
+	}
+	cgi_output_end(c, &o);
+	oflush(c);
+	dolog(c, o.code, o.size);
+}
+
+static void
+backend_var(void *arg, const char *name, const char *val)
+{
+	backend_param(arg, name, val);
+}
+
+/*
+ * Run the request through the -b application server.
+ *
+ * It gets the same variables a CGI would, plus the two that
+ * PHP and friends need to find the script.
+ */
+void
+serve_backend(struct conn *c, char *relpath)
+{
+	struct request *r = &c->r;
+	struct backend *b = &c->backend;
+	struct cgiout o;
+	char buf[BUFFER_SIZE];
+	ssize_t len;
+
+	cgi_output_init(&o);
+
+	if (r->chunked && !backend_streams()) {
+		badrequest(c, 411, "Length Required", "The application server needs a Content-Length.");
+	}
+	settimeout(c, CGI_TIMEOUT + WRITETIMEOUT);
+	if (backend_open(b)) {
+		badrequest(c, 502, "Bad Gateway", "Can't reach the application server.");
+	}
+	cgi_vars(c, relpath, backend_var, b);
+	snprintf(buf, sizeof buf, "/proc/self/fd/%d", docroot(c));
+	len = readlink(buf, o.line, sizeof o.line - 1);
+	if (len > 0) {
+		o.line[len] = 0;
+		backend_param(b, "DOCUMENT_ROOT", o.line);
+		snprintf(buf, sizeof buf, "%s%s", o.line, relpath + 1);
+		backend_param(b, "SCRIPT_FILENAME", buf);
+	}
+
+	if (backend_begin(b, r->content_length)) {
+		badrequest(c, 502, "Bad Gateway", "Can't reach the application server.");
+	}
+	while ((len = read_body(c, buf, sizeof buf))) {
+		if (len < 0) {
+			c->keepalive = 0;
+			done(c);
+		}
+		if (backend_write(b, buf, len)) {
+			badrequest(c, 502, "Bad Gateway", "The application server hung up.");
+		}
+	}
+	if (backend_write(b, NULL, 0)) {
+		badrequest(c, 502, "Bad Gateway", "The application server hung up.");
+	}
+
+	while ((len = backend_read(b, buf, sizeof buf)) > 0) {
+		cgi_output(c, &o, buf, len);
+		if (o.passthru && (-1 == oflush(c))) {
+			break;
+		}
+	}
+	if (-1 == len) {
+		if (!o.passthru) {
+			if (errno == EAGAIN) {
+				badrequest(c, 504, "Gateway Timeout", "The application server is being too slow.");
+			}
+			badrequest(c, 502, "Bad Gateway", "The application server hung up.");
+		}
+		c->keepalive = 0;
+	}
+	if (!o.passthru && !o.linelen && !o.headlen && !o.status) {
+		badrequest(c, 502, "Bad Gateway", "The application server didn't answer.");
+	}
+	backend_close(b);
+
+	cgi_output_end(c, &o);
+	oflush(c);
+	dolog(c, o.code, o.size);
+}
+
+void
+serve_cgi(struct conn *c, char *relpath)
+{
+	int cin[2];
+	int cout[2];
+
+	if (dobackend) {
+		serve_backend(c, relpath);
+		if (!c->keepalive) {
+			done(c);
+		}
+		return;
+	}
+
+	detach(c);
+
+	/*
+	 * Close-on-exec, so other threads' CGIs don't hold these open
+	 */
+	if (pipe2(cin, O_CLOEXEC) || pipe2(cout, O_CLOEXEC)) {
+		badrequest(c, 500, "Internal Server Error", "Server Resource problem.");
+	}
+#ifdef F_SETPIPE_SZ
+	fcntl(cin[0], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+	fcntl(cout[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+#endif
+
+	if (-1 == cgi_spawn(c, relpath, cout[0], cin[1])) {
+		close(cin[0]);
+		close(cin[1]);
+		close(cout[0]);
+		close(cout[1]);
+		badrequest(c, 500, "Internal Server Error", "Unable to run CGI.");
+	}
+	close(cin[1]);
+	close(cout[0]);
+
+	cgi_parent(c, cin[0], cout[1]);
+	if (!c->keepalive) {
+		done(c);
+	}
+}
+
+/*
+ * Main HTTPd
+ */
+
+/*
+ * Ways to send a file, best first.  Each connection starts at the top,
+ * and moves down for good the first time one won't work for it.
+ */
+enum {
+	SEND_SENDFILE,
+	SEND_SPLICE,
+	SEND_MMAP,
+	SEND_READ,
+};
+
+/*
+ * Does errno mean this way of sending won't ever work here?
+ */
+int
+unsupported(int err)
+{
+	return (err == EINVAL) || (err == ENOSYS) || (err == EOPNOTSUPP) || (err == EBADF) || (err == ESPIPE);
+}
+
+/*
+ * File to pipe, pipe to client.
+ * Whatever the client doesn't take waits in the pipe for next time.
+ */
+ssize_t
+splice_file(struct conn *c, size_t count)
+{
+	ssize_t n;
+
+	if (c->pipe[0] == -1) {
+		if (pipe2(c->pipe, O_CLOEXEC)) {
+			return -1;
+		}
+#ifdef F_SETPIPE_SZ
+		fcntl(c->pipe[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+#endif
+	}
+
+	if (!c->piped) {
+		n = splice(c->file, &c->file_off, c->pipe[1], NULL, count, SPLICE_F_MOVE);
+		if (n < 1) {
+			return -1;
+		}
+		c->piped = n;
+	}
+
+	/*
+	 * No SPLICE_F_NONBLOCK: whether this blocks is up to wfd
+	 */
+	n = splice(c->pipe[0], NULL, c->wfd, NULL, c->piped, SPLICE_F_MOVE | SPLICE_F_MORE);
+	if (n > 0) {
+		c->piped -= n;
+	}
+	return n;
+}
+
+/*
+ * Map a piece of the file and write it.  The piece grows while the
+ * client keeps taking all of it, and shrinks when it doesn't.
+ */
+ssize_t
+mmap_file(struct conn *c, size_t count)
+{
+	static long pagesize;
+	struct stat st;
+	off_t base;
+	size_t skew, len;
+	char *map;
+	ssize_t n;
+
+	if (!pagesize) {
+		pagesize = sysconf(_SC_PAGESIZE);
+	}
+	if (!c->chunk) {
+		c->chunk = MMAP_CHUNK_MIN;
+	}
+
+	/*
+	 * Touching a page past the end of a file is SIGBUS,
+	 * so don't map past where it ends now
+	 */
+	if (fstat(c->file, &st)) {
+		return -1;
+	}
+	if (c->file_off >= st.st_size) {
+		errno = EIO;
+		return -1;
+	}
+	len = min(min(count, c->chunk), st.st_size - c->file_off);
+
+	base = c->file_off & ~(off_t) (pagesize - 1);
+	skew = c->file_off - base;
+	map = mmap(NULL, skew + len, PROT_READ, MAP_SHARED, c->file, base);
+	if (map == MAP_FAILED) {
+		return -1;
+	}
+	n = write(c->wfd, map + skew, len);
+	munmap(map, skew + len);
+
+	if (n > 0) {
+		c->file_off += n;
+		if ((n == len) && (c->chunk < MMAP_CHUNK_MAX)) {
+			c->chunk *= 2;
+		} else if ((n < len) && (c->chunk > MMAP_CHUNK_MIN)) {
+			c->chunk /= 2;
+		}
+	}
+	return n;
+}
+
+ssize_t
+fake_sendfile(int out_fd, int in_fd, off_t * offset, size_t count)
+{
+	char buf[BUFFER_SIZE];
+	ssize_t l, m;
+
+	l = pread(in_fd, buf, min(count, sizeof buf), *offset);
+	if (l < 1) {
+		return -1;
+	}
+
+	/*
+	 * Whatever doesn't get written will be read again next time
+	 */
+	m = write(out_fd, buf, l);
+	if (m > 0) {
+		*offset += m;
+	}
+
+	return m;
+}
+
+/*
+ * Send up to count bytes of the file, whichever way works.
+ * Returns like write().
+ */
+ssize_t
+send_file(struct conn *c, size_t count)
+{
+	while (1) {
+		ssize_t n;
+
+		switch (c->sendmode) {
+		case SEND_SENDFILE:
+			n = sendfile(c->wfd, c->file, &c->file_off, count);
+			break;
+		case SEND_SPLICE:
+			n = splice_file(c, count);
+			break;
+		case SEND_MMAP:
+			n = mmap_file(c, count);
+			break;
+		default:
+			return fake_sendfile(c->wfd, c->file, &c->file_off, count);
+		}
+		if ((n > -1) || !unsupported(errno)) {
+			return n;
+		}
+
+		if (c->piped) {
+			/*
+			 * It made it into the pipe but no further:
+			 * back up and send it some other way
+			 */
+			c->file_off -= c->piped;
+			c->piped = 0;
+			close(c->pipe[0]);
+			close(c->pipe[1]);
+			c->pipe[0] = c->pipe[1] = -1;
+		}
+		c->sendmode += 1;
+	}
+}
+
+/*
+ * Work out which bytes of a size-byte file the Range field wants,
+ * into r->ranges.
+ *
+ * Returns how many ranges there are, 0 to ignore the field and send
+ * the whole file, or -1 if none of them are in the file.
+ */
+int
+parse_range(struct request *r, off_t size)
+{
+	unsigned long long usize = size;
+	const char *p = r->range;
+	int n = 0, specs = 0;
+
+	if (strncmp(p, "bytes=", 6)) {
+		return 0;
+	}
+	p += 6;
+
+	while (1) {
+		unsigned long long first, last;
+		char *end;
+
+		for (; (*p == ' ') || (*p == '\t') || (*p == ','); p += 1);
+		if (!*p) {
+			break;
+		}
+
+		if ((*p == '-') && isdigit((unsigned char) p[1])) {
+			/*
+			 * bytes=-500: the last 500
+			 */
+			last = strtoull(p + 1, &end, 10);
+			first = (last < usize) ? usize - last : 0;
+			if (last == 0) {
+				first = usize;
+			}
+			last = usize - 1;
+		} else if (isdigit((unsigned char) *p)) {
+			first = strtoull(p, &end, 10);
+			if (*end != '-') {
+				return 0;
+			}
+			if (isdigit((unsigned char) end[1])) {
+				last = strtoull(end + 1, &end, 10);
+				if (last < first) {
+					return 0;
+				}
+			} else {
+				/*
+				 * bytes=500-: from 500 on
+				 */
+				end += 1;
+				last = ULLONG_MAX;
+			}
+		} else {
+			return 0;
+		}
+
+		for (p = end; (*p == ' ') || (*p == '\t'); p += 1);
+		if (*p && (*p != ',')) {
+			return 0;
+		}
+		specs += 1;
+
+		if (first >= usize) {
+			continue;
+		}
+		if (n == MAXRANGES) {
+			return 0;
+		}
+		r->ranges[n].first = first;
+		r->ranges[n].last = (last < usize) ? last : usize - 1;
+		n += 1;
+	}
+
+	if (!specs) {
+		return 0;
+	}
+	return n ? n : -1;
+}
+
+#define PART_HEADER "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n"
+
+/*
+ * Put the header for part i of a multipart/byteranges response in the
+ * output buffer, or if out is 0, just say how long it would be
+ */
+size_t
+part_header(struct conn *c, int i, int out)
+{
+	struct request *r = &c->r;
+	long long first = r->ranges[i].first;
+	long long last = r->ranges[i].last;
+	long long size = r->range_size;
+	int len = snprintf(NULL, 0, PART_HEADER, r->boundary, r->range_type, first, last, size);
+
+	if (out) {
+		ogrow(c, len + 1);
+		snprintf(c->out + c->outlen, len + 1, PART_HEADER, r->boundary, r->range_type, first, last, size);
+		c->outlen += len;
+	}
+	return len;
+}
+
+/*
+ * Line up the next part of a multipart/byteranges response:
+ * its header goes in the output buffer, and its bytes in file_off and
+ * file_remain.  After the last part comes the closing boundary.
+ *
+ * Returns 0 when there's nothing left.
+ */
+int
+next_part(struct conn *c)
+{
+	struct request *r = &c->r;
+	int i = r->nextrange;
+
+	if (!r->nranges || (i > r->nranges)) {
+		return 0;
+	}
+	r->nextrange += 1;
+
+	if (i == r->nranges) {
+		ostr(c, "\r\n--");
+		ostr(c, r->boundary);
+		ostr(c, "--\r\n");
+		return 1;
+	}
+
+	part_header(c, i, 1);
+	c->file_off = r->ranges[i].first;
+	c->file_remain = r->ranges[i].last - r->ranges[i].first + 1;
+	return 1;
+}
+
+/*
+ * Send queued output, and then the body if there is one.
+ * Returns like oflush().
+ */
+int
+send_response(struct conn *c)
+{
+	int ret;
+
+	do {
+		ret = oflush(c);
+		if (ret < 1) {
+			return ret;
+		}
+
+		while (c->file_remain > 0) {
+			size_t count = min(c->file_remain, SIZE_MAX);
+			ssize_t sent;
+
+			if (!evmode && !nthreads) {
+				alarm(SENDFILE_TIMEOUT);
+			}
+			sent = send_file(c, count);
+			if (-1 == sent) {
+				if (errno == EINTR) {
+					continue;
+				}
+				if (errno == EAGAIN) {
+					if (evmode) {
+						return 0;
+					}
+					settimeout(c, WRITETIMEOUT);
+					if (0 == cwait(c, c->wfd, POLLOUT)) {
+						continue;
+					}
+				}
+			}
+			if (sent < 1) {
+				fprintf(stderr, "Unable to send %s: %m.  Dying.\n", c->r.path);
+				c->file_remain = 0;
+				c->keepalive = 0;
+				ret = -1;
+				break;
+			}
+			c->file_remain -= sent;
+			c->r.sent += sent;
+		}
+	} while ((ret == 1) && next_part(c));
+
+	file_close(c);
+
+	return ret;
+}
+
+/*
+ * The file cache key for path: "./vhost/path"
+ */
+int
+cache_key(struct conn *c, const char *path, char *key, size_t keylen)
+{
+	const char *root = nochdir ? "." : (c->rootfe ? c->rootfe->key : NULL);
+
+	if (!root) {
+		return 0;
+	}
+	return snprintf(key, keylen, "%s%s", root, path + 1) < keylen;
+}
+
+/*
+ * Precompressed copies we look for next to a file, best first
+ */
+static const struct {
+	const char *name;
+	const char *ext;
+} encodings[] = {
+	{"br", ".br"},
+	{"zstd", ".zst"},
+	{"gzip", ".gz"},
+};
+
+#define NENCODINGS (sizeof encodings / sizeof *encodings)
+#define ENC_ALL ((1 << NENCODINGS) - 1)
+#define ENC_GZIP (NENCODINGS - 1)
+
+/*
+ * Parse Accept-Encoding into a mask of encodings[].
+ * val is left alone, the CGI environment still wants it.
+ */
+int
+accept_encoding(const char *val)
+{
+	int yes = 0, no = 0, star = 0;
+	const char *p = val;
+
+	while (*p) {
+		size_t toklen = strcspn(p, ",");
+		size_t len;
+		const char *q;
+		int bit = 0;
+		int i;
+
+		for (; (*p == ' ') || (*p == '\t'); p += 1, toklen -= 1);
+		len = strcspn(p, " \t;,");
+		for (i = 0; i < NENCODINGS; i += 1) {
+			if ((strlen(encodings[i].name) == len) && !strncasecmp(p, encodings[i].name, len)) {
+				bit = 1 << i;
+			}
+		}
+		if ((len == 6) && !strncasecmp(p, "x-gzip", len)) {
+			bit = 1 << ENC_GZIP;
+		}
+		if ((len == 1) && (*p == '*')) {
+			bit = -1;
+		}
+
+		/*
+		 * q=0 means "not this one"; any other q is as good as any other
+		 */
+		q = memchr(p, ';', toklen);
+		if (q && (q = strstr(q, "q=")) && (q < p + toklen) && (strtod(q + 2, NULL) == 0)) {
+			if (bit == -1) {
+				star = 0;
+			} else {
+				no |= bit;
+			}
+		} else if (bit == -1) {
+			star = 1;
+		} else {
+			yes |= bit;
+		}
+
+		p += toklen;
+		if (*p == ',') {
+			p += 1;
+		}
+	}
+
+	return (yes | (star ? ENC_ALL : 0)) & ~no;
+}
+
+/*
+ * Which compressed copies of path are there?
+ */
+int
+find_variants(struct conn *c, const char *path, const char *type)
+{
+	char path2[PATH_MAX];
+	struct stat st;
+	int variants = 0;
+	int i;
+
+	if (!*path || !mime_compressible(type)) {
+		return 0;
+	}
+	for (i = 0; i < NENCODINGS; i += 1) {
+		if ((snprintf(path2, sizeof path2, "%s%s", path, encodings[i].ext) < sizeof path2) &&
+		    !fstatat(docroot(c), path2, &st, 0) && S_ISREG(st.st_mode)) {
+			variants |= 1 << i;
+		}
+	}
+	return variants;
+}
+
+/*
+ * Give c->file to the cache, if it'll take it
+ */
+void
+cache_file(struct conn *c, struct stat *st, const char *type, int variants)
+{
+	char key[PATH_MAX];
+
+	if (cache_key(c, c->r.fspath, key, sizeof key)) {
+		c->fe = fcache_add(key, c->file, st, type, variants);
+	}
+}
+
+/*
+ * Swap c->file for one of path's compressed copies the client will take,
+ * as long as it's no older.  *st becomes the copy's.
+ *
+ * Returns its index in encodings[], or -1 to send path as it is.
+ */
+int
+find_sidecar(struct conn *c, const char *path, int variants, struct stat *st)
+{
+	int want = c->r.accept_encoding & variants;
+	int i;
+
+	if (!want) {
+		return -1;
+	}
+
+	for (i = 0; i < NENCODINGS; i += 1) {
+		char path2[PATH_MAX];
+		char key[PATH_MAX];
+		struct fentry *fe = NULL;
+		struct stat st2;
+		int fd;
+
+		if (!(want & (1 << i))) {
+			continue;
+		}
+		if (snprintf(path2, sizeof path2, "%s%s", path, encodings[i].ext) >= sizeof path2) {
+			continue;
+		}
+
+		if (cache_key(c, path2, key, sizeof key) && (fe = fcache_get(key))) {
+			fd = fe->fd;
+			st2 = fe->st;
+		} else {
+			fd = openat(docroot(c), path2, O_RDONLY | O_CLOEXEC);
+			if (-1 == fd) {
+				continue;
+			}
+			if (fstat(fd, &st2) || !S_ISREG(st2.st_mode)) {
+				close(fd);
+				continue;
+			}
+			if (cache_key(c, path2, key, sizeof key)) {
+				fe = fcache_add(key, fd, &st2, getmimetype(path2), 0);
+			}
+		}
+
+		if (st2.st_mtime < st->st_mtime) {
+			/*
+			 * Stale
+			 */
+			if (fe) {
+				fcache_release(fe);
+			} else {
+				close(fd);
+			}
+			continue;
+		}
+
+		file_close(c);
+		c->file = fd;
+		c->fe = fe;
+		*st = st2;
+		return i;
+	}
+
+	return -1;
+}
+
+/*
+ * Event loop: make the gzipped copy in a child process, so nobody else
+ * on the loop waits for it.  This response goes out as it is.
+ */
+void
+gzip_later(struct conn *c, const struct stat *st)
+{
+	off_t zlen;
+	int zfd;
+
+	if (zcache_making(st) || fork()) {
+		return;
+	}
+	zfd = zcache_open(c->file, st, &zlen);
+	_exit(zfd >= 0 ? 0 : 1);
+}
+
+/*
+ * Swap c->file for a gzipped copy out of the -z directory,
+ * which gets made if it isn't there yet (off to the side, on an event
+ * loop, with this response going out uncompressed).  *st gets the copy's size.
+ *
+ * Returns ENC_GZIP, or -1 to send the file as it is.
+ */
+int
+gzip_file(struct conn *c, const char *type, struct stat *st)
+{
+	off_t zlen;
+	int zfd = -1;
+
+	if (!zcache_dir || !(c->r.accept_encoding & (1 << ENC_GZIP)) || !mime_compressible(type)) {
+		return -1;
+	}
+
+	if (c->fe) {
+		zfd = fcache_zfd(c->fe, &zlen);
+	}
+	if (zfd == -1) {
+		if (evmode) {
+			zfd = zcache_find(st, &zlen);
+			if (zfd == -1) {
+				gzip_later(c, st);
+			}
+		} else {
+			zfd = zcache_open(c->file, st, &zlen);
+		}
+		if (c->fe && (zfd != -1) && fcache_set_zfd(c->fe, zfd, zlen)) {
+			/*
+			 * Somebody beat us to it
+			 */
+			if (zfd >= 0) {
+				close(zfd);
+			}
+			zfd = fcache_zfd(c->fe, &zlen);
+		}
+	}
+	if (zfd < 0) {
+		return -1;
+	}
+
+	if (!c->fe) {
+		close(c->file);
+	}
+	c->file = zfd;
+	st->st_size = zlen;
+	return ENC_GZIP;
+}
+
+/*
+ * Send a response the cache kept for us
+ */
+void
+serve_resp(struct conn *c, struct fresp *resp)
+{
+	size_t len = (c->r.method == HEAD) ? resp->body : resp->len;
+
+	if ((resp->http_version == c->r.http_version) && (resp->keepalive == c->keepalive)) {
+		owrite(c, resp->data, len);
+	} else {
+		header(c, 200, "OK");
+		owrite(c, resp->data + resp->fields, len - resp->fields);
+	}
+	stamp(c, STATS_HEADER);
+	file_close(c);
+
+	if (c->r.method != HEAD) {
+		dolog(c, 200, resp->len - resp->body);
+	}
+}
+
+/*
+ * Read the file in behind the header block that starts at start,
+ * and give the cache a copy of the whole thing
+ */
+void
+keep_resp(struct conn *c, size_t start, size_t fields, int enc)
+{
+	struct fresp *resp;
+	size_t len;
+
+	ogrow(c, c->file_remain);
+	while (c->file_remain > 0) {
+		ssize_t n = pread(c->file, c->out + c->outlen, c->file_remain, c->file_off);
+
+		if (n < 1) {
+			/*
+			 * send_response can sort it out
+			 */
+			return;
+		}
+		c->outlen += n;
+		c->file_off += n;
+		c->file_remain -= n;
+	}
+
+	len = c->outlen - start;
+	resp = malloc(sizeof *resp + len);
+	if (resp) {
+		memcpy(resp->data, c->out + start, len);
+		resp->len = len;
+		resp->fields = fields - start;
+		resp->body = len - c->file_off;
+		resp->http_version = c->r.http_version;
+		resp->keepalive = c->keepalive;
+		resp->encoding = enc;
+		if (fcache_set_resp(c->fe, resp)) {
+			free(resp);
+		}
+	}
+	file_close(c);
+}
+
+/*
+ * A strong validator for the file in *st, as sent with encodings[enc]
+ */
+void
+make_etag(char *buf, size_t buflen, const struct stat *st, int enc)
+{
+	unsigned long long ns = (unsigned long long) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+
+	snprintf(buf, buflen, "\"%llx-%llx-%llx%s%s\"",
+		 (unsigned long long) st->st_ino, (unsigned long long) st->st_size, ns,
+		 (enc == -1) ? "" : "-", (enc == -1) ? "" : encodings[enc].name);
+}
+
+/*
+ * Is etag in If-None-Match's list?
+ * The comparison is weak: W/ doesn't matter.
+ */
+int
+etag_listed(const char *list, const char *etag)
+{
+	size_t len = strlen(etag);
+	const char *p = list;
+
+	while (*p) {
+		size_t toklen;
+
+		for (; (*p == ' ') || (*p == '\t') || (*p == ','); p += 1);
+		if (*p == '*') {
+			return 1;
+		}
+		if (!strncmp(p, "W/", 2)) {
+			p += 2;
+		}
+		toklen = (*p == '"') ? strcspn(p + 1, "\"") + 2 : strcspn(p, ",");
+		if ((toklen == len) && !strncmp(p, etag, len)) {
+			return 1;
+		}
+		p += (toklen < strlen(p)) ? toklen : strlen(p);
+	}
+	return 0;
+}
+
+/*
+ * Does If-Range still describe what we've got?
+ * An entity tag has to match strongly; a date, exactly.
+ */
+int
+if_range_ok(const char *val, const char *etag, time_t mtime)
+{
+	if (!strncmp(val, "W/", 2)) {
+		return 0;
+	}
+	if (*val == '"') {
+		return !strcmp(val, etag);
+	}
+	return timerfc(val) == mtime;
+}
+
+void
+serve_file(struct conn *c, int fd, char *filename, struct stat *stp)
+{
+	struct request *r = &c->r;
+	const char *type = c->fe ? c->fe->type : getmimetype(filename);
+	struct stat st = *stp;
+	char lastmod[40];
+	char etag[80];
+	time_t mtime;
+	size_t start, fields;
+	int variants, vary, enc, nranges;
+	off_t len;
+
+	c->file = fd;
+	if (c->fe) {
+		variants = c->fe->variants;
+	} else {
+		variants = find_variants(c, filename, type);
+		cache_file(c, &st, type, variants);
+	}
+	vary = variants || (zcache_dir && mime_compressible(type));
+
+	if (r->method == POST) {
+		file_close(c);
+		badrequest(c, 405, "Method Not Supported", "POST is not supported by this URL");
+	}
+
+	/*
+	 * Last-Modified is the original's, whichever copy goes out
+	 */
+	mtime = st.st_mtime;
+	if (c->fe) {
+		strcpy(lastmod, c->fe->lastmod);
+	} else {
+		struct tm tm;
+
+		gmtime_r(&st.st_mtime, &tm);
+		strftime(lastmod, sizeof lastmod, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+	}
+
+	enc = find_sidecar(c, filename, variants, &st);
+	if (enc == -1) {
+		enc = gzip_file(c, type, &st);
+	}
+	make_etag(etag, sizeof etag, &st, enc);
+
+	/*
+	 * If-None-Match, when there is one, overrules If-Modified-Since
+	 */
+	if (r->if_none_match ? etag_listed(r->if_none_match, etag) : (mtime <= r->ims)) {
+		file_close(c);
+		header(c, 304, "Not Changed");
+		ofield(c, "ETag", etag);
+		if (vary) {
+			ofield(c, "Vary", "Accept-Encoding");
+		}
+		dolog(c, 304, 0);
+		eoh(c);
+		return;
+	}
+
+	if (r->if_range && !if_range_ok(r->if_range, etag, mtime)) {
+		r->range = NULL;
+	}
+	nranges = r->range ? parse_range(r, st.st_size) : 0;
+
+	if (nranges == -1) {
+		file_close(c);
+		header(c, 416, "Range Not Satisfiable");
+		ostr(c, "Content-Range: bytes */");
+		onum(c, st.st_size);
+		ostr(c, "\r\n");
+		ofieldnum(c, "Content-Length", 0);
+		eoh(c);
+		dolog(c, 416, 0);
+		return;
+	}
+
+	if (c->fe && !nranges) {
+		struct fresp *resp = fcache_resp(c->fe);
+
+		if (resp && (resp->encoding == enc)) {
+			serve_resp(c, resp);
+			return;
+		}
+	}
+
+	/*
+	 * Make sure the header block stays put, in case it gets kept
+	 */
+	ogrow(c, 1024);
+	start = c->outlen;
+	if (nranges) {
+		header(c, 206, "Partial Content");
+	} else {
+		header(c, 200, "OK");
+	}
+	fields = c->outlen;
+
+	if (nranges > 1) {
+		int i;
+
+		r->range_type = type;
+		r->range_size = st.st_size;
+		snprintf(r->boundary, sizeof r->boundary, "%llx%08lx",
+			 (unsigned long long) st.st_mtim.tv_nsec ^ st.st_ino, random());
+		ostr(c, "Content-Type: multipart/byteranges; boundary=");
+		ostr(c, r->boundary);
+		ostr(c, "\r\n");
+
+		len = strlen("\r\n----\r\n") + strlen(r->boundary);
+		for (i = 0; i < nranges; i += 1) {
+			len += part_header(c, i, 0) + r->ranges[i].last - r->ranges[i].first + 1;
+		}
+	} else {
+		ofield(c, "Content-Type", type);
+		if (nranges) {
+			ostr(c, "Content-Range: bytes ");
+			onum(c, r->ranges[0].first);
+			ostr(c, "-");
+			onum(c, r->ranges[0].last);
+			ostr(c, "/");
+			onum(c, st.st_size);
+			ostr(c, "\r\n");
+			len = r->ranges[0].last - r->ranges[0].first + 1;
+		} else {
+			len = st.st_size;
+		}
+	}
+	if (enc != -1) {
+		ofield(c, "Content-Encoding", encodings[enc].name);
+	}
+	if (vary) {
+		ofield(c, "Vary", "Accept-Encoding");
+	}
+	ofieldnum(c, "Content-Length", len);
+	ofield(c, "Last-Modified", lastmod);
+	ofield(c, "ETag", etag);
+	ofield(c, "Accept-Ranges", "bytes");
+
+	eoh(c);
+
+	if (r->method == HEAD) {
+		file_close(c);
+		return;
+	}
+
+	/*
+	 * Whoever is driving the connection sends it
+	 */
+	if (nranges > 1) {
+		r->nranges = nranges;
+		next_part(c);
+	} else if (nranges) {
+		c->file_off = r->ranges[0].first;
+		c->file_remain = len;
+	} else {
+		c->file_off = 0;
+		c->file_remain = len;
+		if (c->fe && (len <= smallfile_max) && (strlen(type) < 256)) {
+			keep_resp(c, start, fields, enc);
+		}
+	}
+
+	dolog(c, nranges ? 206 : 200, len);
+}
+
+/*
+ * List a directory.  The rows come out of the listing cache,
+ * so the directory only gets read when it's changed.
+ * On an event loop, a big one gets read in a child.
+ */
+void
+serve_idx(struct conn *c, int fd, char *path)
+{
+	struct dlist *l;
+	char esc[PATH_MAX * 5];
+	char head[sizeof esc * 2 + 200];
+	static const char tail[] = "</pre></body></html>";
+	int headlen;
+	size_t len;
+
+	if (c->r.method == POST) {
+		close(fd);
+		badrequest(c, 405, "Method Not Supported", "POST is not supported by this URL");
+	}
+
+	l = dcache_get(fd, evmode ? DIRLIST_INLINE : 0);
+	if (!l && (errno == EFBIG)) {
+		/*
+		 * On the connection, fd gets closed in the parent
+		 */
+		c->file = fd;
+		detach(c);
+		c->file = -1;
+		l = dcache_get(fd, 0);
+	}
+	close(fd);
+	if (!l) {
+		badrequest(c, 500, "Internal Server Error", "Unable to read directory.");
+	}
+
+	html_esc(esc, sizeof esc, path);
+	headlen = snprintf(head, sizeof head,
+			   "<!DOCTYPE html>\r<html><head><title>%s</title></head>"
+			   "<body><h1>Directory Listing: %s</h1><pre>\n%s",
+			   esc, esc, path[1] ? "<a href=\"../\">Parent Directory</a>\n" : "");
+
+	len = headlen + l->len + sizeof tail - 1;
+	header(c, 200, "OK");
+	ofield(c, "Content-Type", "text/html");
+	ofieldnum(c, "Content-Length", len);
+	eoh(c);
+	if (c->r.method != HEAD) {
+		owrite(c, head, headlen);
+		owrite(c, l->html, l->len);
+		owrite(c, tail, sizeof tail - 1);
+	}
+	dcache_release(l);
+
+	dolog(c, 200, len);
+}
+
+/*
+ * Serve relpath, which somebody already tried to open and stat.
+ * If fd is -1, errno says why.
+ */
+void
+serve_opened(struct conn *c, char *relpath, int fd, struct stat *stp)
+{
+	struct stat st;
+
+	stamp(c, STATS_OPEN);
+
+	/*
+	 * If it opened, 
+	 */
+	if (fd > -1) {
+		st = *stp;
+		/*
+		 * If it is a directory, 
+		 */
+		if (S_ISDIR(st.st_mode)) {
+			char path2[PATH_MAX];
+			int fd2;
+
+			/*
+			 * Redirect if it doesn't end with / 
+			 */
+			if (!endswith(c->r.path, "/")) {
+				close(fd);
+				header(c, 301, "Redirect");
+				ostr(c, "Location: ");
+				ostr(c, c->r.path);
+				ostr(c, "/\r\n");
+				eoh(c);
+				return;
+			}
+
+			/*
+			 * Open relpath + "index.html".  If that worked,
+			 */
+			snprintf(path2, sizeof path2, "%sindex.html", relpath);
+			if ((fd2 = openat(docroot(c), path2, O_RDONLY | O_CLOEXEC)) > -1) {
+				/*
+				 * serve that file and return. 
+				 */
+				close(fd);
+				fstat(fd2, &st);
+				serve_file(c, fd2, path2, &st);
+				return;
+			} else {
+				if (docgi) {
+					snprintf(path2, sizeof path2, "%sindex.cgi", relpath);
+					if (!fstatat(docroot(c), path2, &st, 0)) {
+						close(fd);
+						return serve_cgi(c, path2);
+					}
+				}
+				if (doidx) {
+					serve_idx(c, fd, relpath + 1);
+					return;
+				}
+				close(fd);
+				return not_found(c);
+			}
+		} else {
+			if (docgi && endswith(relpath, ".cgi")) {
+				close(fd);
+				return serve_cgi(c, relpath);
+			}
+			serve_file(c, fd, relpath, &st);
+		}
+	} else {
+		if (docgi && (errno == ENOTDIR)) {
+			char *p;
+
+			if ((p = strstr(relpath, ".cgi"))) {
+				p += 4;
+				c->r.path_info = strdup(p);
+				*p = 0;
+				if (!fstatat(docroot(c), relpath, &st, 0)) {
+					return serve_cgi(c, relpath);
+				}
+			}
+		}
+		return not_found(c);
+	}
+}
+
+/*
+ * Serve the request out of the file cache.
+ * Returns 0 if it isn't in there.
+ */
+int
+serve_cached(struct conn *c)
+{
+	char key[PATH_MAX];
+	struct fentry *e;
+
+	if (!cache_key(c, c->r.fspath, key, sizeof key) || !(e = fcache_get(key))) {
+		return 0;
+	}
+
+	/*
+	 * "dir/" is dir/index.html, but only if the URL has the slash
+	 */
+	if (endswith(key, "/") && !endswith(c->r.path, "/")) {
+		fcache_release(e);
+		return 0;
+	}
+
+	c->fe = e;
+	stamp(c, STATS_OPEN);
+	if (endswith(key, "/")) {
+		char path[PATH_MAX];
+
+		if (snprintf(path, sizeof path, "%sindex.html", c->r.fspath) >= sizeof path) {
+			path[0] = 0;
+		}
+		serve_file(c, e->fd, path, &e->st);
+	} else {
+		serve_file(c, e->fd, c->r.fspath, &e->st);
+	}
+	return 1;
+}
+
+void
+find_serve_file(struct conn *c, char *relpath)
+{
+	int fd;
+	struct stat st;
+
+	if (serve_cached(c)) {
+		return;
+	}
+
+	/*
+	 * Open fspath.
+	 */
+	if ((fd = openat(docroot(c), relpath, O_RDONLY | O_CLOEXEC)) > -1) {
+		fstat(fd, &st);
+	}
+	serve_opened(c, relpath, fd, &st);
+}
+
+void
+parse_request_line(struct conn *c, char *request, int truncated)
+{
+	struct request *r = &c->r;
+	char *p;
+
+	if (!strncmp(request, "GET /", 5)) {
+		r->method = GET;
+		p = request + 4;
+	} else if (!strncmp(request, "POST /", 6)) {
+		r->method = POST;
+		p = request + 5;
+	} else if (!strncmp(request, "HEAD /", 6)) {
+		r->method = HEAD;
+		p = request + 5;
+	} else if (connector && !strncmp(request, "CONNECT ", 8)) {
+		r->method = CONNECT;
+		p = request + 8;
+	} else {
+		badrequest(c, 405, "Method Not Allowed", "Unsupported HTTP method.");
+	}
+
+	/*
+	 * Interpret path into fspath. 
+	 */
+	r->path = p;
+	{
+		char *fsp = r->fspath;
+		char *end = p + strlen(p);
+
+		*(fsp++) = '.';
+		for (;; p += 1) {
+			size_t n = find_delim(p, end - p, ' ', '?', '%', ' ');
+			size_t room = sizeof r->fspath - 1 - (fsp - r->fspath);
+			char ch;
+
+			/*
+			 * Copy the run of ordinary characters in one go
+			 */
+			if (!r->query_string) {
+				if (n < room) {
+					room = n;
+				}
+				memcpy(fsp, p, room);
+				fsp += room;
+			}
+			p += n;
+
+			ch = *p;
+			if (ch == 0) {
+				if (truncated) {
+					badrequest(c, 413, "Request Entity Too Large", "The HTTP request was too long");
+				}
+				badrequest(c, 505, "Version Not Supported", "HTTP/0.9 not supported");
+			} else if (ch == ' ') {
+				break;
+			} else if (ch == '?') {
+				r->query_string = p + 1;
+			} else if ((!r->query_string) && p[1] && p[2]) {
+				int a = fromhex(p[1]);
+				int b = fromhex(p[2]);
+
+				if ((a >= 0) && (b >= 0)) {
+					ch = (a << 4) | b;
+					p += 2;
+				}
+			}
+
+			if ((!r->query_string) && (fsp - r->fspath + 1 < sizeof r->fspath)) {
+				*(fsp++) = ch;
+			}
+		}
+		*fsp = 0;
+
+		/*
+		 * Change "/." to "/:" to keep "hidden" files such and prevent directory traversal 
+		 */
+		while ((fsp = strstr(r->fspath, "/."))) {
+			*(fsp + 1) = ':';
+		}
+
+
+		*(p++) = 0;	/* NULL-terminate path */
+	}
+
+	r->http_version = -1;
+	if (!strncmp(p, "HTTP/1.", 7) && p[7] && ((p[8] == 0) || ((p[8] == '\r') && (p[9] == 0)))) {
+		r->http_version = p[7] - '0';
+	}
+	if (!((r->http_version == 0) || (r->http_version == 1))) {
+		r->http_version = 0;
+		badrequest(c, 505, "Version Not Supported", "HTTP version not supported");
+	}
+	if (r->http_version == 1) {
+		c->keepalive = 1;
+	} else {
+		c->keepalive = 0;
+	}
+	stamp(c, STATS_READ);
+}
+
+/*
+ * Header fields we do something with.
+ * Looked up by hash, since every request has a bunch of these.
+ */
+enum field {
+	F_OTHER,
+	F_HOST,
+	F_USER_AGENT,
+	F_REFERER,
+	F_CONTENT_TYPE,
+	F_CONTENT_LENGTH,
+	F_CONNECTION,
+	F_IF_MODIFIED_SINCE,
+	F_RANGE,
+	F_ACCEPT_ENCODING,
+	F_IF_NONE_MATCH,
+	F_IF_RANGE,
+	F_TRANSFER_ENCODING,
+};
+
+static const struct {
+	const char *name;
+	enum field field;
+} known_fields[] = {
+	{"HOST", F_HOST},
+	{"USER_AGENT", F_USER_AGENT},
+	{"REFERER", F_REFERER},
+	{"CONTENT_TYPE", F_CONTENT_TYPE},
+	{"CONTENT_LENGTH", F_CONTENT_LENGTH},
+	{"CONNECTION", F_CONNECTION},
+	{"IF_MODIFIED_SINCE", F_IF_MODIFIED_SINCE},
+	{"RANGE", F_RANGE},
+	{"ACCEPT_ENCODING", F_ACCEPT_ENCODING},
+	{"IF_NONE_MATCH", F_IF_NONE_MATCH},
+	{"IF_RANGE", F_IF_RANGE},
+	{"TRANSFER_ENCODING", F_TRANSFER_ENCODING},
+};
+
+#define FIELDTAB_SIZE 32	/* power of 2, and then some */
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME 16777619u
+
+static struct {
+	unsigned int hash;
+	const char *name;
+	enum field field;
+} fieldtab[FIELDTAB_SIZE];
+static size_t fieldtab_maxlen;
+
+void
+fieldtab_init()
+{
+	int i;
+
+	for (i = 0; i < sizeof known_fields / sizeof *known_fields; i += 1) {
+		const char *p;
+		unsigned int h = FNV_OFFSET;
+		unsigned int j;
+
+		for (p = known_fields[i].name; *p; p += 1) {
+			h = (h ^ (unsigned char) *p) * FNV_PRIME;
+		}
+		if (p - known_fields[i].name > fieldtab_maxlen) {
+			fieldtab_maxlen = p - known_fields[i].name;
+		}
+		for (j = h; fieldtab[j % FIELDTAB_SIZE].name; j += 1);
+		fieldtab[j % FIELDTAB_SIZE].hash = h;
+		fieldtab[j % FIELDTAB_SIZE].name = known_fields[i].name;
+		fieldtab[j % FIELDTAB_SIZE].field = known_fields[i].field;
+	}
+}
+
+enum field
+field_lookup(const char *name, unsigned int h)
+{
+	unsigned int j;
+
+	for (j = h; fieldtab[j % FIELDTAB_SIZE].name; j += 1) {
+		if ((fieldtab[j % FIELDTAB_SIZE].hash == h) && !strcmp(fieldtab[j % FIELDTAB_SIZE].name, name)) {
+			return fieldtab[j % FIELDTAB_SIZE].field;
+		}
+	}
+	return F_OTHER;
+}
+
+/*
+ * Parse one header line of length len, in place.
+ * Field names get turned into CGI environment style (USER_AGENT),
+ * and hashed along the way.
+ *
+ * Returns 1 for the blank line at the end of the header block
+ */
+int
+parse_header_field(struct conn *c, char *line, size_t len)
+{
+	struct request *r = &c->r;
+	char *name, *val, *p;
+	char *end = line + len;
+	unsigned int h = FNV_OFFSET;
+
+	for (; (end > line) && ((end[-1] == '\r') || (end[-1] == '\n')); end -= 1);
+	*end = 0;
+	if (end == line) {
+		/*
+		 * blank line
+		 */
+		if (r->chunked && (r->content_length || (r->method != POST))) {
+			/*
+			 * Content-Length means nothing next to chunked, and
+			 * only CGIs read bodies: either way, we might not
+			 * be able to tell where the next request starts.
+			 */
+			r->content_length = 0;
+			c->keepalive = 0;
+		}
+		return 1;
+	}
+
+	p = line + find_delim(line, len, ':', ':', ':', ':');
+	if (p == end) {
+		badrequest(c, 400, "Invalid header", "Unable to parse header block");
+	}
+	if ((p == line) || field_name(line, p - line)) {
+		badrequest(c, 400, "Invalid header", "Invalid header field name");
+	}
+	*p = 0;
+
+	/*
+	 * Nothing longer than the longest field we know about needs hashing
+	 */
+	if (p - line <= fieldtab_maxlen) {
+		for (name = line; name < p; name += 1) {
+			h = (h ^ (unsigned char) *name) * FNV_PRIME;
+		}
+	}
+	for (val = p + 1; *val == ' '; val += 1);
+
+	if (r->nfields >= MAXHEADERFIELDS) {
+		badrequest(c, 431, "Request Header Too Large", "Too many HTTP Headers");
+	}
+
+	name = line;
+	r->fields[r->nfields].name = name;
+	r->fields[r->nfields].val = val;
+	r->nfields += 1;
+
+	/*
+	 * Handle special header fields
+	 */
+	switch (field_lookup(name, h)) {
+	case F_OTHER:
+		break;
+	case F_HOST:
+		r->host = val;
+		break;
+	case F_USER_AGENT:
+		r->user_agent = val;
+		break;
+	case F_REFERER:
+		r->refer = val;
+		break;
+	case F_CONTENT_TYPE:
+		r->content_type = val;
+		break;
+	case F_CONTENT_LENGTH:
+		r->content_length = (size_t) strtoull(val, NULL, 10);
+		break;
+	case F_CONNECTION:
+		if (!strcasecmp(val, "keep-alive")) {
+			c->keepalive = 1;
+		} else {
+			c->keepalive = 0;
+		}
+		break;
+	case F_IF_MODIFIED_SINCE:
+		r->ims = timerfc(val);
+		break;
+	case F_RANGE:
+		r->range = val;
+		break;
+	case F_ACCEPT_ENCODING:
+		r->accept_encoding = accept_encoding(val);
+		break;
+	case F_IF_NONE_MATCH:
+		r->if_none_match = val;
+		break;
+	case F_IF_RANGE:
+		r->if_range = val;
+		break;
+	case F_TRANSFER_ENCODING:
+		if (strcasecmp(val, "chunked")) {
+			badrequest(c, 501, "Not Implemented", "Only chunked request bodies are supported");
+		}
+		r->chunked = 1;
+		break;
+	}
+
+	return 0;
+}
+
+/*
+ * Parse whatever of the request header block has come in so far.
+ *
+ * Returns 1 when the whole block is in, or 0 if we need more.
+ */
+int
+scan_request(struct conn *c)
+{
+	char *nl;
+
+	if (dostats && !c->r.begin && c->inlen) {
+		c->r.begin = stats_now();
+	}
+
+	/*
+	 * Pick up where we left off: no need to look through a partial
+	 * line again when more of it comes in
+	 */
+	while ((nl = memchr(c->in + c->seen, '\n', c->inlen - c->seen))) {
+		char *line = c->in + c->scan;
+
+		*nl = 0;
+		c->scan = c->seen = nl - c->in + 1;
+		if (!c->r.path) {
+			parse_request_line(c, line, 0);
+		} else if (parse_header_field(c, line, nl - line)) {
+			c->reqlen = c->hdrlen = c->scan;
+			if (logtimes) {
+				clock_gettime(CLOCK_MONOTONIC, &c->r.start);
+			}
+			stamp(c, STATS_PARSE);
+			return 1;
+		}
+	}
+	c->seen = c->inlen;
+
+	if (!c->r.path && (c->inlen >= MAXREQUESTLEN)) {
+		c->in[MAXREQUESTLEN - 1] = 0;
+		parse_request_line(c, c->in, 1);
+	}
+	if (c->inlen >= MAXHEADERLEN) {
+		badrequest(c, 431, "Request Header Too Large", "The HTTP header block was too large");
+	}
+
+	return 0;
+}
+
+/*
+ * The client isn't sending any more of the header block
+ */
+void
+read_failed(struct conn *c)
+{
+	if (0 == c->inlen) {
+		/*
+		 * They must have hung up!
+		 */
+		c->keepalive = 0;
+		done(c);
+	} else if (!c->r.path) {
+		/*
+		 * Whatever we got is all the request line we'll get
+		 */
+		c->in[c->inlen] = 0;
+		parse_request_line(c, c->in, 0);
+	} else {
+		badrequest(c, 500, "OS Error", "OS error reading headers");
+	}
+}
+
+/*
+ * Read and parse the request header block.
+ *
+ * Returns 1 when the whole block is in, or 0 if we have to wait for more
+ * (event loop only).
+ */
+int
+read_request(struct conn *c)
+{
+	while (!scan_request(c)) {
+		ssize_t len = read(c->rfd, c->in + c->inlen, MAXHEADERLEN - c->inlen);
+
+		if (len > 0) {
+			c->inlen += len;
+		} else if ((-1 == len) && (errno == EINTR)) {
+			continue;
+		} else if ((-1 == len) && (errno == EAGAIN)) {
+			if (evmode) {
+				return 0;
+			}
+			if (-1 == cwait(c, c->rfd, POLLIN)) {
+				c->keepalive = 0;
+				done(c);
+			}
+		} else {
+			read_failed(c);
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * Open a vhost directory, or get it from the cache
+ */
+int
+vhost_open(struct conn *c, const char *name)
+{
+	char key[PATH_MAX];
+	int fd;
+
+	snprintf(key, sizeof key, "./%s", name);
+	if ((c->rootfe = fcache_get(key))) {
+		return c->rootfe->fd;
+	}
+	fd = openat(cwd, name, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (-1 != fd) {
+		c->rootfe = fcache_add(key, fd, NULL, NULL, 0);
+	}
+	return fd;
+}
+
+/*
+ * -S: is this a request for the phase timings?
+ */
+int
+is_stats_path(const char *path)
+{
+	static const char stats_path[] = "/.well-known/eris-status";
+	size_t n = sizeof stats_path - 1;
+
+	return !strncmp(path, stats_path, n) && ((path[n] == 0) || (path[n] == '?'));
+}
+
+/*
+ * The phase timings, as text, or with ?format=prometheus for Prometheus
+ */
+void
+serve_stats(struct conn *c)
+{
+	int prometheus = c->r.query_string && !strcmp(c->r.query_string, "format=prometheus");
+	size_t len;
+	char *buf;
+
+	if (c->r.method == POST) {
+		badrequest(c, 405, "Method Not Supported", "POST is not supported by this URL");
+	}
+	if (!(buf = stats_render(prometheus, &len))) {
+		badrequest(c, 500, "Internal Server Error", "Unable to gather statistics.");
+	}
+
+	header(c, 200, "OK");
+	ofield(c, "Content-Type", prometheus ? "text/plain; version=0.0.4" : "text/plain");
+	ofield(c, "Cache-Control", "no-cache");
+	ofieldnum(c, "Content-Length", len);
+	eoh(c);
+	if (c->r.method != HEAD) {
+		owrite(c, buf, len);
+	}
+	free(buf);
+
+	dolog(c, 200, len);
+	done(c);
+}
+
+void
+handle_request(struct conn *c)
+{
+	struct request *r = &c->r;
+	char *p;
+
+	if (dostats && is_stats_path(r->path)) {
+		serve_stats(c);
+	}
+
+	/*
+	 * Find the appropriate directory 
+	 */
+	if (!nochdir) {
+		char fn[PATH_MAX];
+
+		if (r->host) {
+			snprintf(fn, sizeof(fn), "%s", r->host);
+		} else {
+			fn[0] = 0;
+		}
+		if (fn[0] == '.') {
+			fn[0] = ':';
+		}
+		for (p = fn; *p; p += 1) {
+			switch (*p) {
+			case '/':
+				*p = ':';
+				break;
+			case ':':
+				*p = 0;
+				break;
+			case 'A' ... 'Z':
+				*p ^= ' ';
+				break;
+			}
+		}
+
+		/*
+		 * Files get opened relative to a directory handle:
+		 * with threads or the ring, lots of requests are in flight,
+		 * and the working directory isn't any one request's to change.
+		 */
+		c->root = vhost_open(c, fn);
+		if (-1 == c->root) {
+			strcpy(fn, "default");
+			c->root = vhost_open(c, fn);
+		}
+		if (-1 == c->root) {
+			badrequest(c, 404, "Not Found", "This host is not served here");
+		}
+		if (dostats) {
+			r->vhost = stats_vhost(fn);
+		}
+	} else if (dostats) {
+		r->vhost = stats_vhost(".");
+	}
+	stamp(c, STATS_VHOST);
+
+	if (r->method == CONNECT) {
+		detach(c);
+		if (in_worker) {
+			/*
+			 * The connector takes over the connection, the worker carries on
+			 */
+			c->keepalive = 0;
+			if (fork()) {
+				c->detached = 1;
+				done(c);
+			}
+			in_worker = 0;
+			logbuf_forked();
+		}
+		alarm(0);
+		fcntl(c->rfd, F_SETFL, fcntl(c->rfd, F_GETFL) & ~O_NONBLOCK);
+		dup2(c->rfd, 0);
+		dup2(c->wfd, 1);
+		execl(connector, connector, r->path, NULL);
+		badrequest(c, 500, "Unable to exec connector", strerror(errno));
+	}
+
+	/*
+	 * Serve the file 
+	 */
+	settimeout(c, WRITETIMEOUT);
+	if (useuring) {
+		/*
+		 * The ring opens it, and serve_opened() takes it from there
+		 */
+		return;
+	}
+	find_serve_file(c, r->fspath);
+}
+
+/*
+ * Set up c for a new connection, hanging on to its output buffer
+ */
+void
+conn_init(struct conn *c, int rfd, int wfd)
+{
+	char *out = c->out;
+	size_t outsize = c->outsize;
+
+	memset(c, 0, sizeof *c);
+	c->out = out;
+	c->outsize = outsize;
+	c->rfd = rfd;
+	c->wfd = wfd;
+	c->file = -1;
+	c->root = -1;
+	c->cgi_in = -1;
+	c->cgi_out = -1;
+	c->pipe[0] = c->pipe[1] = -1;
+	c->backend.fd = -1;
+	settimeout(c, READTIMEOUT);
+}
+
+/*
+ * Is there another whole request already buffered up behind this one?
+ */
+int
+pipelined(struct conn *c)
+{
+	char *p = c->in + c->reqlen;
+	char *end = c->in + c->inlen;
+
+	while ((p = memchr(p, '\n', end - p))) {
+		p += 1;
+		if ((p < end) && (*p == '\n')) {
+			return 1;
+		}
+		if ((p + 1 < end) && (p[0] == '\r') && (p[1] == '\n')) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * If another request is already waiting, fold this response into the
+ * output buffer, so they can all go out together in one write.
+ *
+ * Returns 1 if it did, and the next request can get going.
+ */
+int
+coalesce(struct conn *c)
+{
+	if (!c->keepalive || (c->outlen >= PIPELINE_MAX) || c->r.nranges || !pipelined(c)) {
+		return 0;
+	}
+	if (c->file != -1) {
+		if (c->file_remain > PIPELINE_BODY_MAX) {
+			return 0;
+		}
+		ogrow(c, c->file_remain);
+		while (c->file_remain > 0) {
+			ssize_t len = pread(c->file, c->out + c->outlen, c->file_remain, c->file_off);
+
+			if (len < 1) {
+				/*
+				 * send_response can sort it out
+				 */
+				return 0;
+			}
+			c->outlen += len;
+			c->file_off += len;
+			c->file_remain -= len;
+		}
+		file_close(c);
+	}
+
+	return 1;
+}
+
+struct conn *
+conn_new(int rfd, int wfd)
+{
+	struct conn *c = calloc(1, sizeof *c);
+
+	if (c) {
+		conn_init(c, rfd, wfd);
+	}
+
+	return c;
+}
+
+/*
+ * Get ready for the next request on a connection
+ */
+void
+next_request(struct conn *c)
+{
+	finish_request(c);
+	memmove(c->in, c->in + c->reqlen, c->inlen - c->reqlen);
+	c->inlen -= c->reqlen;
+	c->scan = 0;
+	c->seen = 0;
+	c->reqlen = 0;
+
+	free(c->r.path_info);
+	memset(&c->r, 0, sizeof c->r);
+	cgi_close(c);
+	root_close(c);
+
+	settimeout(c, READTIMEOUT);
+}
+
+/*
+ * Serve requests on a connection with blocking I/O, until it's done
+ */
+void
+serve_connection(struct conn *c)
+{
+	while (1) {
+		if (0 == sigsetjmp(c->jmp, 1)) {
+			read_request(c);
+			handle_request(c);
+		}
+		if (c->detached) {
+			return;
+		}
+		if (!coalesce(c)) {
+			if ((send_response(c) < 1) || !c->keepalive) {
+				return;
+			}
+		}
+		next_request(c);
+	}
+}
+
+/*
+ * Listener
+ */
+
+int
+listen_socket(const char *addr)
+{
+	char buf[256];
+	char *node, *service;
+	struct addrinfo hints, *res, *ai;
+	int fd = -1;
+	int one = 1;
+	int ret;
+
+	snprintf(buf, sizeof buf, "%s", addr);
+	service = strrchr(buf, ':');
+	if (!service) {
+		fprintf(stderr, "Listen address must be ADDR:PORT\n");
+		exit(69);
+	}
+	*(service++) = 0;
+	node = buf;
+	if (*node == '[') {
+		node += 1;
+		if (endswith(node, "]")) {
+			node[strlen(node) - 1] = 0;
+		}
+	}
+	if (!*node) {
+		node = NULL;
+	}
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if ((ret = getaddrinfo(node, service, &hints, &res))) {
+		fprintf(stderr, "%s: %s\n", addr, gai_strerror(ret));
+		exit(69);
+	}
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+		if (-1 == fd) {
+			continue;
+		}
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+		if ((0 == bind(fd, ai->ai_addr, ai->ai_addrlen)) && (0 == listen(fd, SOMAXCONN))) {
+			break;
 		}
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
 
-		if (FD_ISSET(cin, &rfds)) {
-			if (passthru) {
-				/*
-				 * Pass everything through verbatim 
-				 */
-				size_t len;
+	if (-1 == fd) {
+		fprintf(stderr, "Unable to listen on %s: %m\n", addr);
+		exit(69);
+	}
 
-				/*
-				 * Re-use this big buffer 
-				 */
-				len = fread(cgiheader, 1, sizeof cgiheader, cinf);
-				if (0 == len) {
-					/*
-					 * CGI is done 
-					 */
-					break;
-				}
-				fwrite(cgiheader, 1, len, stdout);
+	return fd;
+}
 
-				/*
-				 * Naively assume the CGI knows best about sending stuff 
-				 */
-				fflush(stdout);
-				size += len;
-			} else {
-				/*
-				 * Interpret header fields 
-				 */
-				size_t readlen = (sizeof cgiheader) - cgiheaderlen;
+/*
+ * Format a peer address the way busybox does: ip:port or [ip6]:port
+ */
+char *
+peer_addr(struct sockaddr *sa, socklen_t salen)
+{
+	char ip[NI_MAXHOST];
+	char port[NI_MAXSERV];
+	char buf[NI_MAXHOST + NI_MAXSERV + 4];
 
-				if (NULL == fgets(cgiheader + cgiheaderlen, readlen, cinf)) {
-					/*
-					 * EOF or error 
-					 */
-					badrequest(500, "CGI Error", "CGI output too weird");
-				}
-				cgiheaderlen = strlen(cgiheader);
-
-				if ('\n' == cgiheader[cgiheaderlen - 1]) {
-					/*
-					 * We read a whole line 
-					 */
-					size_t len;
-					char *val;
-
-					len = extract_header_field(cgiheader, &val, 0);
-					if (!len) {
-						/*
-						 * We've read the entire header block 
-						 */
-						passthru = 1;
-						eoh();
-					} else {
-						if (!header_sent) {
-							if (!strcasecmp(cgiheader, "Location")) {
-								header(302, "CGI Redirect");
-								printf("%s: %s\r\n\r\n", cgiheader, val);
-								dolog(302, 0);
-								exit(0);
-							} else if (!strcasecmp(cgiheader, "Status")) {
-								char *txt;
-
-								if (val) {
-									code = (int) strtol(val, &txt, 10);
-								} else {
-									code = 0;
-								}
-								if (code < 100) {
-									header(500, "Internal Error");
-									printf("CGI returned Status: %d\n", code);
-									dolog(500, 0);
-									exit(0);
-								}
-								for (; *txt == ' '; txt += 1);
-								header(code, txt);
-							} else {
-								header(200, "OK");
-								printf("Pragma: no-cache\r\n");
-							}
-							header_sent = 1;
-						}
-						printf("%s: %s\r\n", cgiheader, val);
-						cgiheaderlen = 0;
-					}
-				}
+	if (getnameinfo(sa, salen, ip, sizeof ip, port, sizeof port, NI_NUMERICHOST | NI_NUMERICSERV)) {
+		return NULL;
+	}
+	if (sa->sa_family == AF_INET6) {
+		snprintf(buf, sizeof buf, "[%s]:%s", ip, port);
+	} else {
+		snprintf(buf, sizeof buf, "%s:%s", ip, port);
+	}
+	return strdup(buf);
+}
+
+/*
+ * Headers and bodies can go out in separate writes: don't let Nagle
+ * sit on the second one waiting for a delayed ACK.
+ */
+void
+nodelay(int fd)
+{
+	int one = 1;
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+}
+
+/*
+ * Event loop: one process, lots of connections
+ */
+
+void
+ev_watch(struct conn *c, uint32_t events)
+{
+	struct epoll_event ev;
+
+	if (c->events == events) {
+		return;
+	}
+	ev.events = events;
+	ev.data.ptr = c;
+	epoll_ctl(epfd, EPOLL_CTL_MOD, c->rfd, &ev);
+	c->events = events;
+}
+
+/*
+ * Make as much progress on a connection as we can without blocking
+ */
+void
+ev_run(struct conn *c)
+{
+	while (1) {
+		if (c->sending) {
+			int ret = send_response(c);
+
+			if (0 == ret) {
+				settimeout(c, WRITETIMEOUT);
+				ev_watch(c, EPOLLOUT);
+				return;
 			}
-		} else if (FD_ISSET(cout, &wfds)) {
+			if ((-1 == ret) || !c->keepalive) {
+				conn_close(c);
+				return;
+			}
+			c->sending = 0;
+			next_request(c);
+		}
+
+		if (0 == sigsetjmp(c->jmp, 0)) {
+			if (!read_request(c)) {
+				ev_watch(c, EPOLLIN);
+				return;
+			}
+			handle_request(c);
+		}
+
+		if (c->detached) {
 			/*
-			 * write to cgi the post data 
+			 * A child has it now
 			 */
-			if (content_length) {
-				size_t len;
-				char buf[BUFFER_SIZE];
-				size_t nmemb = min(BUFFER_SIZE, content_length);
-				char *p = buf;
-
-				len = fread(buf, 1, nmemb, stdin);
-				if (len < 1) {
-					break;
-				}
-				content_length -= len;
+			conn_close(c);
+			return;
+		}
+		if (!evmode) {
+			/*
+			 * We're the child, and we get to block
+			 */
+			send_response(c);
+			finish_request(c);
+			exit(0);
+		}
+		if (coalesce(c)) {
+			next_request(c);
+			continue;
+		}
+		c->sending = 1;
+	}
+}
+
+void
+ev_accept()
+{
+	while (1) {
+		struct sockaddr_storage ss;
+		socklen_t sslen = sizeof ss;
+		struct epoll_event ev;
+		struct conn *c;
+		int fd;
+
+		fd = accept4(listen_fd, (struct sockaddr *) &ss, &sslen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (-1 == fd) {
+			return;
+		}
+		if ((fd >= maxconns) || !(c = conn_new(fd, fd))) {
+			close(fd);
+			continue;
+		}
+		c->remote_addr = peer_addr((struct sockaddr *) &ss, sslen);
+		nodelay(fd);
+		c->events = EPOLLIN;
+		ev.events = c->events;
+		ev.data.ptr = c;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+		conns[fd] = c;
+		if (fd > maxfd) {
+			maxfd = fd;
+		}
 
-				while (len > 0) {
-					size_t wlen = write(cout, p, len);
+		/*
+		 * The request might already be here
+		 */
+		ev_run(c);
+	}
+}
 
-					if (wlen == -1) {
-						break;
-					}
-					len -= wlen;
-					p += wlen;
-				}
+void
+event_loop()
+{
+	struct epoll_event ev, events[MAXEVENTS];
+	time_t last = 0;
+
+	maxconns = sysconf(_SC_OPEN_MAX);
+	conns = calloc(maxconns, sizeof *conns);
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (!conns || (-1 == epfd)) {
+		fprintf(stderr, "Unable to start event loop: %m\n");
+		exit(1);
+	}
+
+	fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+	ev.events = EPOLLIN;
+#ifdef EPOLLEXCLUSIVE
+	ev.events |= EPOLLEXCLUSIVE;
+#endif
+	ev.data.ptr = NULL;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev);
+
+	signal(SIGCHLD, sigchld);
+
+	while (1) {
+		int i, n;
+		time_t now;
+
+		n = epoll_wait(epfd, events, MAXEVENTS, 1000);
+		for (i = 0; i < n; i += 1) {
+			struct conn *c = events[i].data.ptr;
+
+			if (c) {
+				ev_run(c);
 			} else {
-				close(cout);
+				ev_accept();
+			}
+		}
+
+		/*
+		 * Time out stragglers, once a second
+		 */
+		now = time(NULL);
+		if (now != last) {
+			int fd;
+
+			for (fd = 0; fd <= maxfd; fd += 1) {
+				struct conn *c = conns[fd];
+
+				if (c && (c->deadline < now)) {
+					conn_close(c);
+				}
 			}
+			last = now;
 		}
 	}
+}
+
+/*
+ * io_uring event loop: the same idea as the epoll one, except that the
+ * kernel does the accepting, reading, opening, and sending, and we hand
+ * it a whole batch of work per system call.
+ *
+ * Each SQE's user_data is the connection pointer with the operation
+ * in the low bits.  Completions with no connection are for the loop itself.
+ */
+
+#define UR_ACCEPT	1	/* no connection */
+#define UR_TICK		2	/* no connection */
+#define UR_IGNORE	3	/* no connection */
+
+#define UR_RECV		1
+#define UR_OPEN		2
+#define UR_STATX	3
+#define UR_READ		4
+#define UR_SEND		5
+#define UR_POLL		6	/* precedes a linked retry */
+#define UR_WRITABLE	7	/* socket can take more of a sendfile */
 
-	fflush(stdout);
-	dolog(code, size);
+#define UR_MASK		7
+
+/*
+ * Everything the loop asks the ring to do
+ */
+static const int uring_ops[] = {
+	IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_POLL_ADD,
+	IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_CLOSE,
+	IORING_OP_TIMEOUT,
+};
+
+static struct sockaddr_storage ur_ss;
+static socklen_t ur_sslen;
+static struct __kernel_timespec ur_second = { 1, 0 };
+
+void ur_request(struct conn *c, int res);
+
+struct io_uring_sqe *
+ur_sqe(struct conn *c, int op, int tag)
+{
+	struct io_uring_sqe *sqe = uring_sqe(&ring);
+
+	if (!sqe) {
+		fprintf(stderr, "io_uring submission queue is stuck: %m.  Dying.\n");
+		exit(1);
+	}
+	sqe->opcode = op;
+	sqe->user_data = (uintptr_t) c | tag;
+	if (c) {
+		c->pending += 1;
+	}
+	return sqe;
 }
 
 void
-serve_cgi(char *relpath)
+ur_accept()
 {
-	int pid;
-	int cin[2];
-	int cout[2];
+	struct io_uring_sqe *sqe = ur_sqe(NULL, IORING_OP_ACCEPT, UR_ACCEPT);
 
-	if (pipe(cin) || pipe(cout)) {
-		badrequest(500, "Internal Server Error", "Server Resource problem.");
-	}
+	ur_sslen = sizeof ur_ss;
+	sqe->fd = listen_fd;
+	sqe->addr = (uintptr_t) &ur_ss;
+	sqe->addr2 = (uintptr_t) &ur_sslen;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+}
 
-	pid = fork();
-	if (-1 == pid) {
-		badrequest(500, "Internal Server Error", "Unable to fork.");
-	}
-	if (pid) {
-		close(cin[1]);
-		close(cout[0]);
+void
+ur_tick()
+{
+	struct io_uring_sqe *sqe = ur_sqe(NULL, IORING_OP_TIMEOUT, UR_TICK);
 
-		/*
-		 * Eris is not this smart yet 
-		 */
-		keepalive = 0;
+	sqe->fd = -1;
+	sqe->addr = (uintptr_t) &ur_second;
+	sqe->len = 1;
+}
 
-		cgi_parent(cin[0], cout[1], 0);
+/*
+ * Close a file without waiting around for it
+ */
+void
+ur_closefd(int fd)
+{
+	struct io_uring_sqe *sqe = ur_sqe(NULL, IORING_OP_CLOSE, UR_IGNORE);
 
-		exit(0);
-	} else {
-		close(cwd);
-		close(cout[1]);
-		close(cin[0]);
+	sqe->fd = fd;
+}
 
-		dup2(cout[0], 0);
-		dup2(cin[1], 1);
+/*
+ * Wait for the socket to be ready.
+ * UR_POLL links to the next SQE, which runs once it is.
+ */
+void
+ur_poll(struct conn *c, int events, int tag)
+{
+	struct io_uring_sqe *sqe = ur_sqe(c, IORING_OP_POLL_ADD, tag);
 
-		close(cout[0]);
-		close(cin[1]);
+	sqe->fd = c->rfd;
+	sqe->poll32_events = events;
+	if (UR_POLL == tag) {
+		sqe->flags = IOSQE_IO_LINK;
+	}
+}
+
+void
+ur_recv(struct conn *c, int wait)
+{
+	struct io_uring_sqe *sqe;
 
-		cgi_child(relpath);
+	if (wait) {
+		ur_poll(c, POLLIN, UR_POLL);
 	}
+	sqe = ur_sqe(c, IORING_OP_RECV, UR_RECV);
+	sqe->fd = c->rfd;
+	sqe->addr = (uintptr_t) (c->in + c->inlen);
+	sqe->len = MAXHEADERLEN - c->inlen;
+}
+
+void
+ur_open(struct conn *c)
+{
+	int root = docroot(c);
+	struct io_uring_sqe *sqe;
+
+	sqe = ur_sqe(c, IORING_OP_OPENAT, UR_OPEN);
+	sqe->fd = root;
+	sqe->addr = (uintptr_t) c->r.fspath;
+	sqe->open_flags = O_RDONLY | O_CLOEXEC;
+
+	sqe = ur_sqe(c, IORING_OP_STATX, UR_STATX);
+	sqe->fd = root;
+	sqe->addr = (uintptr_t) c->r.fspath;
+	sqe->len = STATX_BASIC_STATS;
+	sqe->addr2 = (uintptr_t) &c->stx;
+
+	c->opening = 2;
 }
 
 /*
- * Main HTTPd
+ * Close the connection once the ring is done with it
  */
+void
+ur_close(struct conn *c)
+{
+	if (c->closing) {
+		return;
+	}
+	c->closing = 1;
+	if (c->pending) {
+		/*
+		 * Knock loose whatever is waiting on the socket
+		 */
+		shutdown(c->rfd, SHUT_RDWR);
+		return;
+	}
+	conn_close(c);
+}
 
-ssize_t
-fake_sendfile(int out_fd, int in_fd, off_t * offset, size_t count)
+/*
+ * Send whatever's left of the response
+ */
+void
+ur_send(struct conn *c, int wait)
 {
-	char buf[BUFFER_SIZE];
-	ssize_t l, m;
+	if (c->outoff < c->outlen) {
+		struct io_uring_sqe *sqe;
+
+		if (wait) {
+			ur_poll(c, POLLOUT, UR_POLL);
+		}
+		sqe = ur_sqe(c, IORING_OP_SEND, UR_SEND);
+		sqe->fd = c->wfd;
+		sqe->addr = (uintptr_t) (c->out + c->outoff);
+		sqe->len = c->outlen - c->outoff;
+		sqe->msg_flags = MSG_NOSIGNAL | ((c->file_remain > 0) ? MSG_MORE : 0);
+		return;
+	}
 
 	/*
-	 * is mmap quicker? does it matter? 
+	 * Big files go out with sendfile, same as the epoll loop
 	 */
-	if (-1 == lseek(in_fd, *offset, SEEK_SET)) {
-		/*
-		 * We're screwed.  The most helpful thing we can do now is die. 
-		 */
-		fprintf(stderr, "Unable to seek.  Dying.\n");
-		exit(0);
+	switch (send_response(c)) {
+	case 0:
+		settimeout(c, WRITETIMEOUT);
+		ur_poll(c, POLLOUT, UR_WRITABLE);
+		return;
+	case -1:
+		ur_close(c);
+		return;
+	}
+
+	if (!c->keepalive) {
+		ur_close(c);
+		return;
+	}
+	next_request(c);
+	ur_request(c, 1);
+}
+
+/*
+ * The response is ready to go: send it, unless there's a pipelined
+ * request to add to the pile first
+ */
+void
+ur_flush(struct conn *c)
+{
+	if ((c->file == -1) && coalesce(c)) {
+		next_request(c);
+		ur_request(c, 1);
+		return;
+	}
+	ur_send(c, 0);
+}
+
+/*
+ * Queue up the response that's been built
+ */
+void
+ur_respond(struct conn *c)
+{
+	if (c->detached) {
+		ur_close(c);
+		return;
 	}
-	l = read(in_fd, buf, min(count, sizeof buf));
-	if (-1 == l) {
+	if (!evmode) {
 		/*
-		 * Also screwed. 
+		 * We're the child, and we get to block
 		 */
-		fprintf(stderr, "Unable to read an open file.  Dying.\n");
+		send_response(c);
+		finish_request(c);
 		exit(0);
 	}
-	*offset += l;
+	if (c->rootfe) {
+		root_close(c);
+	} else if (c->root != -1) {
+		ur_closefd(c->root);
+		c->root = -1;
+	}
 
-	while (l) {
-		m = write(out_fd, buf, l);
-		if (-1 == m) {
-			/*
-			 * ALSO screwed. 
-			 */
-			fprintf(stderr, "Unable to write to client: %m (req %s).  Dying.\n", path);
-			exit(0);
+	if ((c->file != -1) && (c->file_remain > 0) && (c->file_remain <= URING_READ_MAX) && !c->r.nranges) {
+		struct io_uring_sqe *sqe;
+
+		ogrow(c, c->file_remain);
+		sqe = ur_sqe(c, IORING_OP_READ, UR_READ);
+		sqe->fd = c->file;
+		sqe->addr = (uintptr_t) (c->out + c->outlen);
+		sqe->len = c->file_remain;
+		sqe->off = c->file_off;
+		return;
+	}
+
+	ur_flush(c);
+}
+
+/*
+ * Parse what's come in, and get the ring going on whatever's next.
+ * res is the result of the recv, or 1 if there wasn't one.
+ */
+void
+ur_request(struct conn *c, int res)
+{
+	if (0 == sigsetjmp(c->jmp, 0)) {
+		if (res < 1) {
+			read_failed(c);
+		}
+		if (!scan_request(c)) {
+			ur_recv(c, 0);
+			return;
+		}
+		handle_request(c);
+		if (!serve_cached(c)) {
+			ur_open(c);
+			return;
+		}
+	}
+	ur_respond(c);
+}
+
+/*
+ * openat and statx are both back
+ */
+void
+ur_opened(struct conn *c)
+{
+	struct request *r = &c->r;
+	struct stat st;
+	int fd = c->openfd;
+
+	if (fd > -1) {
+		if (c->stat_err) {
+			fstat(fd, &st);
+		} else {
+			memset(&st, 0, sizeof st);
+			st.st_dev = makedev(c->stx.stx_dev_major, c->stx.stx_dev_minor);
+			st.st_ino = c->stx.stx_ino;
+			st.st_mode = c->stx.stx_mode;
+			st.st_size = c->stx.stx_size;
+			st.st_mtim.tv_sec = c->stx.stx_mtime.tv_sec;
+			st.st_mtim.tv_nsec = c->stx.stx_mtime.tv_nsec;
+		}
+	}
+
+	if (0 == sigsetjmp(c->jmp, 0)) {
+		errno = c->open_err;
+		serve_opened(c, r->fspath, fd, &st);
+	}
+	ur_respond(c);
+}
+
+void
+ur_complete(struct conn *c, int tag, int res)
+{
+	c->pending -= 1;
+	if (c->closing) {
+		if ((UR_OPEN == tag) && (res > -1)) {
+			close(res);
+		}
+		if (0 == c->pending) {
+			conn_close(c);
+		}
+		return;
+	}
+
+	switch (tag) {
+	case UR_POLL:
+		/*
+		 * The linked operation gets its own completion
+		 */
+		break;
+	case UR_RECV:
+		if (-EAGAIN == res) {
+			ur_recv(c, 1);
+		} else if (res > 0) {
+			c->inlen += res;
+			ur_request(c, 1);
+		} else {
+			ur_request(c, res);
+		}
+		break;
+	case UR_OPEN:
+	case UR_STATX:
+		if (UR_OPEN == tag) {
+			c->openfd = (res < 0) ? -1 : res;
+			c->open_err = (res < 0) ? -res : 0;
+		} else {
+			c->stat_err = (res < 0) ? -res : 0;
+		}
+		if (0 == --c->opening) {
+			ur_opened(c);
+		}
+		break;
+	case UR_READ:
+		if (res < 1) {
+			fprintf(stderr, "Unable to read %s: %s.  Dying.\n", c->r.path, strerror(-res));
+			ur_close(c);
+			break;
+		}
+		c->outlen += res;
+		c->file_off += res;
+		c->file_remain -= res;
+		if (c->file_remain > 0) {
+			ur_respond(c);
+			break;
+		}
+		if (c->fe) {
+			file_close(c);
+		} else {
+			ur_closefd(c->file);
+			c->file = -1;
+		}
+		ur_flush(c);
+		break;
+	case UR_SEND:
+		if (-EAGAIN == res) {
+			settimeout(c, WRITETIMEOUT);
+			ur_send(c, 1);
+		} else if (res < 1) {
+			ur_close(c);
+		} else {
+			c->outoff += res;
+			c->r.sent += res;
+			if (c->outoff == c->outlen) {
+				c->outoff = c->outlen = 0;
+			}
+			ur_send(c, 0);
 		}
-		l -= m;
+		break;
+	case UR_WRITABLE:
+		ur_send(c, 0);
+		break;
 	}
-
-	return l;
 }
 
 void
-serve_file(int fd, char *filename, struct stat *st)
+ur_accepted(int fd)
 {
-	off_t len, remain;
+	struct conn *c;
 
-	if (method == POST) {
-		badrequest(405, "Method Not Supported", "POST is not supported by this URL");
+	if (fd < 0) {
+		return;
 	}
-
-	if (st->st_mtime <= ims) {
-		header(304, "Not Changed");
-		dolog(304, 0);
-		eoh();
+	if ((fd >= maxconns) || !(c = conn_new(fd, fd))) {
+		close(fd);
 		return;
 	}
-
-	header(200, "OK");
-	printf("Content-Type: %s\r\n", getmimetype(filename));
-
-	if ((range_end == 0) || (range_end > st->st_size)) {
-		range_end = st->st_size;
+	c->remote_addr = peer_addr((struct sockaddr *) &ur_ss, ur_sslen);
+	nodelay(fd);
+	conns[fd] = c;
+	if (fd > maxfd) {
+		maxfd = fd;
 	}
-	len = range_end - range_start;
-	printf("Content-Length: %llu\r\n", (unsigned long long) len);
+	ur_recv(c, 0);
+}
 
-	{
-		struct tm *tp;
-		char buf[40];
+/*
+ * Returns only if the ring couldn't be set up
+ */
+void
+uring_loop()
+{
+	maxconns = sysconf(_SC_OPEN_MAX);
+	conns = calloc(maxconns, sizeof *conns);
+	if (!conns || (-1 == uring_init(&ring, URING_ENTRIES, uring_ops, sizeof uring_ops / sizeof *uring_ops))) {
+		free(conns);
+		useuring = 0;
+		return;
+	}
 
-		tp = gmtime(&(st->st_mtime));
+	signal(SIGCHLD, sigchld);
 
-		strftime(buf, sizeof buf, "%a, %d %b %Y %H:%M:%S GMT", tp);
-		printf("Last-Modified: %s\r\n", buf);
-	}
+	ur_accept();
+	ur_tick();
+	while (1) {
+		struct io_uring_cqe *cqe;
 
-	eoh();
-	fflush(stdout);
+		if ((-1 == uring_enter(&ring, 1)) && (errno != EINTR) && (errno != EBUSY)) {
+			fprintf(stderr, "Unable to run io_uring: %m.  Dying.\n");
+			exit(1);
+		}
 
-	if (method == HEAD) {
-		return;
-	}
+		while ((cqe = uring_cqe(&ring))) {
+			struct conn *c = (struct conn *) (uintptr_t) (cqe->user_data & ~(uint64_t) UR_MASK);
+			int tag = cqe->user_data & UR_MASK;
+			int res = cqe->res;
+
+			uring_cqe_seen(&ring);
+			if (c) {
+				ur_complete(c, tag, res);
+			} else if (UR_ACCEPT == tag) {
+				ur_accepted(res);
+				ur_accept();
+			} else if (UR_TICK == tag) {
+				time_t now = time(NULL);
+				int fd;
 
-	for (remain = len; remain;) {
-		size_t count = min(remain, SIZE_MAX);
-		ssize_t sent;
+				/*
+				 * Time out stragglers, once a second
+				 */
+				for (fd = 0; fd <= maxfd; fd += 1) {
+					struct conn *o = conns[fd];
 
-		alarm(SENDFILE_TIMEOUT);
-		sent = sendfile(1, fd, &range_start, count);
-		if (-1 == sent) {
-			sent = fake_sendfile(1, fd, &range_start, count);
+					if (o && (o->deadline < now)) {
+						ur_close(o);
+					}
+				}
+				ur_tick();
+			}
 		}
-		remain -= sent;
 	}
-
-	dolog(200, len);
 }
 
-void
-serve_idx(int fd, char *path)
-{
-	DIR *d = fdopendir(fd);
-	struct dirent *de;
-
-	if (method == POST) {
-		badrequest(405, "Method Not Supported", "POST is not supported by this URL");
-	}
+/*
+ * Thread pool: each thread takes connections off the listen socket's
+ * queue and serves them with non-blocking sockets, waiting in poll
+ * until the connection's deadline.  Nothing uses SIGALRM.
+ */
 
-	keepalive = 0;
-	header(200, "OK");
-	printf("Content-Type: text/html\r\n");
-	eoh();
+void *
+worker_thread(void *arg)
+{
+	struct conn *c = calloc(1, sizeof *c);
 
-	printf("<!DOCTYPE html>\r<html><head><title>");
-	html_esc(stdout, path);
-	printf("</title></head><body><h1>Directory Listing: ");
-	html_esc(stdout, path);
-	printf("</h1><pre>\n");
-	if (path[1]) {
-		printf("<a href=\"../\">Parent Directory</a>\n");
+	if (!c) {
+		fprintf(stderr, "Out of memory.  Dying.\n");
+		exit(1);
 	}
 
-	while ((de = readdir(d))) {
-		char *name = de->d_name;
-		char symlink[PATH_MAX];
-		struct stat st;
-
-		if (name[0] == '.') {
-			continue;	/* hidden files -> skip */
-		}
-		if (lstat(name, &st)) {
-			continue;	/* can't stat -> skip */
-		}
-
-		if (S_ISDIR(st.st_mode)) {
-			printf("[DIR]	 ");
-		} else if (S_ISLNK(st.st_mode)) {
-			ssize_t len = readlink(de->d_name, symlink, (sizeof symlink) - 1);
+	while (1) {
+		struct sockaddr_storage ss;
+		socklen_t sslen = sizeof ss;
+		int fd;
 
-			if (len < 1) {
-				continue;
+		fd = accept4(listen_fd, (struct sockaddr *) &ss, &sslen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (-1 == fd) {
+			if ((errno != EINTR) && (errno != ECONNABORTED)) {
+				/*
+				 * Out of file descriptors or buffers: trying again
+				 * right away would just spin until some come back
+				 */
+				poll(NULL, 0, 100);
 			}
-			name = symlink;
-			printf("[LNK]	 ");	/* symlink */
-		} else if (S_ISREG(st.st_mode)) {
-			printf("%10llu", (unsigned long long) st.st_size);
-		} else {
-			continue;	/* not a file we can provide -> skip */
+			continue;
 		}
 
 		/*
-		 * write a href 
+		 * The connection state is this thread's, and gets reused
 		 */
-		printf("  <a href=\"");
-		url_esc(stdout, name);
-		if (S_ISDIR(st.st_mode)) {
-			printf("/");
+		conn_init(c, fd, fd);
+		c->remote_addr = peer_addr((struct sockaddr *) &ss, sslen);
+		nodelay(fd);
+
+		serve_connection(c);
+
+		if (!in_worker) {
+			/*
+			 * We're a child that was handed the connection
+			 */
+			finish_request(c);
+			exit(0);
 		}
-		printf("\">");
-		url_esc(stdout, name);
-		printf("</a>\n");
+		conn_release(c);
 	}
-	printf("</pre></body></html>");
 
-	dolog(200, 0);
+	return NULL;
 }
 
 void
-find_serve_file(char *relpath)
+thread_pool()
 {
-	int fd;
-	struct stat st;
+	pthread_attr_t attr;
+	int i;
 
 	/*
-	 * Open fspath.  If that worked, 
+	 * Keep an eye on this if you make any big stack buffers
 	 */
-	if ((fd = open(relpath, O_RDONLY)) > -1) {
-		fstat(fd, &st);
-		/*
-		 * If it is a directory, 
-		 */
-		if (S_ISDIR(st.st_mode)) {
-			char path2[PATH_MAX];
-			int fd2;
-
-			/*
-			 * Redirect if it doesn't end with / 
-			 */
-			if (!endswith(path, "/")) {
-				header(301, "Redirect");
-				printf("Location: %s/\r\n", path);
-				eoh();
-				return;
-			}
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, THREAD_STACK_SIZE);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
 
-			/*
-			 * Open relpath + "index.html".  If that worked,
-			 */
-			snprintf(path2, sizeof path2, "%sindex.html", relpath);
-			if ((fd2 = open(path2, O_RDONLY)) > -1) {
-				/*
-				 * serve that file and return. 
-				 */
-				fstat(fd2, &st);
-				serve_file(fd2, path2, &st);
-				close(fd2);
-				close(fd);
-				return;
-			} else {
-				if (docgi) {
-					snprintf(path2, sizeof path2, "%sindex.cgi", relpath);
-					if (!stat(path2, &st)) {
-						return serve_cgi(path2);
-					}
-				}
-				if (doidx) {
-					serve_idx(fd, relpath + 1);
-					close(fd);
-					return;
-				}
-				return not_found();
-			}
-		} else {
-			if (docgi && endswith(relpath, ".cgi")) {
-				close(fd);
-				return serve_cgi(relpath);
-			}
-			serve_file(fd, relpath, &st);
-		}
-	} else {
-		if (docgi && (errno == ENOTDIR)) {
-			char *p;
+	signal(SIGCHLD, sigchld);
+	for (i = 1; i < nthreads; i += 1) {
+		pthread_t t;
+		int ret = pthread_create(&t, &attr, worker_thread, NULL);
 
-			if ((p = strstr(relpath, ".cgi"))) {
-				p += 4;
-				env("PATH_INFO", p);
-				*p = 0;
-				if (!stat(relpath, &st)) {
-					close(fd);
-					return serve_cgi(relpath);
-				}
-			}
+		if (ret) {
+			fprintf(stderr, "Unable to start thread %d: %s\n", i, strerror(ret));
+			break;
 		}
-		return not_found();
 	}
+	worker_thread(NULL);
 }
 
 void
-handle_request()
+worker()
 {
-	char request[MAXREQUESTLEN];
-	char fspath[PATH_MAX];
-	char buf[MAXHEADERLEN];
-	char *p;
+	in_worker = 1;
 
 	/*
-	 * Initialize globals 
+	 * Without -t or an event loop, a worker is a pool of one thread.
+	 * Timeouts are deadlines it waits for in poll: an alarm would have
+	 * to longjmp out of whatever was running, malloc included, in a
+	 * process that carries on serving.
 	 */
-	host = NULL;
-	user_agent = NULL;
-	refer = NULL;
-	path = NULL;
-	range_start = 0;
-	range_end = 0;
-	content_type = NULL;
-	content_length = 0;
-	ims = 0;
-
-	alarm(READTIMEOUT);
+	if (!evmode && !nthreads) {
+		nthreads = 1;
+	}
 
-	/*
-	 * Read request line first 
-	 */
-	request[0] = 0;
-	if (NULL == fgets(request, sizeof request, stdin)) {
-		/*
-		 * They must have hung up! 
-		 */
-		exit(0);
+	if (logbuf_init()) {
+		fprintf(stderr, "Not batching log lines: %m\n");
 	}
-	if (!strncmp(request, "GET /", 5)) {
-		method = GET;
-		p = request + 4;
-	} else if (!strncmp(request, "POST /", 6)) {
-		method = POST;
-		p = request + 5;
-	} else if (!strncmp(request, "HEAD /", 6)) {
-		method = HEAD;
-		p = request + 5;
-	} else if (connector && !strncmp(request, "CONNECT ", 8)) {
-		method = CONNECT;
-		p = request + 8;
-	} else {
-		/*
-		 * This also handles the case where fgets does nothing 
-		 */
-		badrequest(405, "Method Not Allowed", "Unsupported HTTP method.");
+	if (fcache_init(fcache_size, SMALLFILE_MEMORY)) {
+		fprintf(stderr, "Not caching files: %m\n");
 	}
+	dcache_init(DIRLIST_MEMORY);
 
-	if (docgi) {
-		p[-1] = 0;
-		env("REQUEST_METHOD", request);
+	if (useuring) {
+		uring_loop();
 	}
+	if (evmode) {
+		event_loop();
+	}
+	thread_pool();
+}
 
-	/*
-	 * Interpret path into fspath. 
-	 */
-	path = p;
-	{
-		char *fsp = fspath;
-		char *query_string = NULL;
-
-		*(fsp++) = '.';
-		for (; *p != ' '; p += 1) {
-			char c = *p;
-
-			switch (c) {
-			case 0:
-				badrequest(413, "Request Entity Too Large", "The HTTP request was too long");
-			case '\n':
-				badrequest(505, "Version Not Supported", "HTTP/0.9 not supported");
-			case '?':
-				query_string = p + 1;
-				break;
-			case '%':
-				if ((!query_string) && p[1] && p[2]) {
-					int a = fromhex(p[1]);
-					int b = fromhex(p[2]);
-
-					if ((a >= 0) && (b >= 0)) {
-						c = (a << 4) | b;
-						p += 2;
-					}
-				}
-				break;
-			}
-
-			if ((!query_string) && (fsp - fspath + 1 < sizeof fspath)) {
-				*(fsp++) = c;
-			}
-		}
-		*fsp = 0;
+static volatile sig_atomic_t stopping = 0;
+static volatile sig_atomic_t dumping = 0;
 
-		/*
-		 * Change "/." to "/:" to keep "hidden" files such and prevent directory traversal 
-		 */
-		while ((fsp = strstr(fspath, "/."))) {
-			*(fsp + 1) = ':';
-		}
+static void
+sigterm(int sig)
+{
+	stopping = 1;
+}
 
+static void
+sigusr1(int sig)
+{
+	dumping = 1;
+}
 
-		*(p++) = 0;	/* NULL-terminate path */
+/*
+ * -S: write the phase timings to stderr
+ */
+void
+dump_stats()
+{
+	size_t len;
+	char *buf = stats_render(0, &len);
 
-		if (docgi && query_string) {
-			env("QUERY_STRING", query_string);
-		}
+	if (buf) {
+		fwrite(buf, 1, len, stderr);
+		free(buf);
 	}
+}
 
-	http_version = -1;
-	if (!strncmp(p, "HTTP/1.", 7) && p[8] && ((p[8] == '\r') || (p[8] == '\n'))) {
-		http_version = p[7] - '0';
-	}
-	if (!((http_version == 0) || (http_version == 1))) {
-		http_version = 0;
-		badrequest(505, "Version Not Supported", "HTTP version not supported");
-	}
-	if (http_version == 1) {
-		keepalive = 1;
-	} else {
-		keepalive = 0;
-	}
-	if (docgi) {
-		p[8] = 0;
-		env("SERVER_PROTOCOL", p);
-	}
+pid_t
+spawn_worker()
+{
+	sigset_t mask, omask;
+	pid_t pid;
 
 	/*
-	 * Read header fields 
+	 * Don't let a signal sneak in before the worker has default handlers
 	 */
-	{
-		char *base = buf;
-		char *lastchar = base + (sizeof buf) - 2;
-		int nheaders = 0;
-
-		*lastchar = 0;
-		while (1) {
-			char *cgi_name = base;
-			char *p;
-			int plen = (sizeof buf) - (base - buf);
-			char *name, *val;
-			size_t len;
-
-			/*
-			 * 40 is totally arbitrary here. 
-			 */
-			if (plen < 40) {
-				badrequest(431, "Request Header Too Large", "The HTTP header block was too large");
-			}
-			if (nheaders++ >= MAXHEADERFIELDS) {
-				badrequest(431, "Request Header Too Large", "Too many HTTP Headers");
-			}
-			strcpy(cgi_name, "HTTP_");
-			plen -= 5;
-			p = cgi_name + 5;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGUSR1);
+	sigprocmask(SIG_BLOCK, &mask, &omask);
 
-			if (NULL == fgets(p, plen, stdin)) {
-				badrequest(500, "OS Error", "OS error reading headers");
-			}
-			if (*lastchar) {
-				badrequest(431, "Request Header Too Large", "An HTTP header field was too large");
-			}
+	pid = fork();
+	if (0 == pid) {
+		signal(SIGTERM, SIG_DFL);
+		signal(SIGINT, SIG_DFL);
+		signal(SIGUSR1, SIG_IGN);	/* the listener's to answer */
+		sigprocmask(SIG_SETMASK, &omask, NULL);
+		worker();
+		exit(0);
+	}
 
-			len = extract_header_field(p, &val, 1);
-			if (!len) {
-				/*
-				 * blank line 
-				 */
-				break;
-			}
-			if (!val) {
-				badrequest(400, "Invalid header", "Unable to parse header block");
-			}
+	sigprocmask(SIG_SETMASK, &omask, NULL);
+	return pid;
+}
 
-			name = p;
+/*
+ * Bind, pre-fork workers, and replace them as they die
+ */
+void
+listener()
+{
+	pid_t *pids = calloc(nworkers, sizeof *pids);
+	struct sigaction sa;
+	struct rlimit rl;
+	int i;
 
-			/*
-			 * Set up CGI environment variables 
-			 */
-			if (docgi) {
-				env(cgi_name, val);
-			}
+	listen_fd = listen_socket(listen_addr);
 
-			/*
-			 * By default, re-use buffer space 
-			 */
-			base = cgi_name;
+	/*
+	 * Cached files are open files: take all we're allowed,
+	 * and leave half for connections
+	 */
+	if (!getrlimit(RLIMIT_NOFILE, &rl)) {
+		rlim_t cur = rl.rlim_cur;
 
-			/*
-			 * Handle special header fields 
-			 */
-			if (!strcmp(name, "HOST")) {
-				host = val;
-				base = name + len + 1;
-			} else if (!strcmp(name, "USER_AGENT")) {
-				user_agent = val;
-				base = name + len + 1;
-			} else if (!strcmp(name, "REFERER")) {
-				refer = val;
-				base = name + len + 1;
-			} else if (!strcmp(name, "CONTENT_TYPE")) {
-				content_type = val;
-				base = name + len + 1;
-			} else if (!strcmp(name, "CONTENT_LENGTH")) {
-				content_length = (size_t) strtoull(val, NULL, 10);
-			} else if (!strcmp(name, "CONNECTION")) {
-				if (!strcasecmp(val, "keep-alive")) {
-					keepalive = 1;
-				} else {
-					keepalive = 0;
-				}
-			} else if (!strcmp(name, "IF_MODIFIED_SINCE")) {
-				ims = timerfc(val);
-			} else if (!strcmp(name, "RANGE")) {
-				/*
-				 * Range: bytes=17-23 
-				 */
-				/*
-				 * Range: bytes=23- 
-				 */
-				if (!strncmp(val, "bytes=", 6)) {
-					p = val + 6;
-					range_start = (off_t) strtoull(p, &p, 10);
-					if (*p == '-') {
-						range_end = (off_t) strtoull(p + 1, NULL, 10);
-					} else {
-						range_end = 0;
-					}
-				}
-			}
+		rl.rlim_cur = rl.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &rl)) {
+			rl.rlim_cur = cur;
+		}
+		if (fcache_size > rl.rlim_cur / 2) {
+			fcache_size = rl.rlim_cur / 2;
 		}
 	}
 
-	/*
-	 * Try to change into the appropriate directory 
-	 */
-	if (!nochdir) {
-		char fn[PATH_MAX];
+	if (useuring) {
+		struct uring u;
 
-		if (host) {
-			snprintf(fn, sizeof(fn), "%s", host);
+		/*
+		 * Find out now, instead of once per worker
+		 */
+		if (-1 == uring_init(&u, 1, uring_ops, sizeof uring_ops / sizeof *uring_ops)) {
+			fprintf(stderr, "io_uring isn't available (%m), using epoll\n");
+			useuring = 0;
 		} else {
-			fn[0] = 0;
+			uring_free(&u);
 		}
-		if (fn[0] == '.') {
-			fn[0] = ':';
+	}
+
+	memset(&sa, 0, sizeof sa);
+	sa.sa_handler = sigterm;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	if (dostats) {
+		sa.sa_handler = sigusr1;
+		sigaction(SIGUSR1, &sa, NULL);
+	}
+
+	for (i = 0; i < nworkers; i += 1) {
+		pids[i] = spawn_worker();
+	}
+
+	while (!stopping) {
+		pid_t pid;
+
+		if (dumping) {
+			dumping = 0;
+			dump_stats();
 		}
-		for (p = fn; *p; p += 1) {
-			switch (*p) {
-			case '/':
-				*p = ':';
-				break;
-			case ':':
-				*p = 0;
-				break;
-			case 'A' ... 'Z':
-				*p ^= ' ';
-				break;
+		pid = wait(NULL);
+		if (-1 == pid) {
+			if (errno != EINTR) {
+				sleep(1);
 			}
+			continue;
 		}
-
-		if ((-1 == chdir(fn)) && (-1 == chdir("default"))) {
-			badrequest(404, "Not Found", "This host is not served here");
+		for (i = 0; i < nworkers; i += 1) {
+			if (pids[i] == pid) {
+				pids[i] = stopping ? 0 : spawn_worker();
+			}
 		}
 	}
 
-	if (method == CONNECT) {
-		execl(connector, connector, path, NULL);
-		badrequest(500, "Unable to exec connector", strerror(errno));
+	for (i = 0; i < nworkers; i += 1) {
+		if (pids[i] > 0) {
+			kill(pids[i], SIGTERM);
+		}
 	}
-
-	/*
-	 * Serve the file 
-	 */
-	alarm(WRITETIMEOUT);
-	find_serve_file(fspath);
-	fflush(stdout);
-
-	return;
+	exit(0);
 }
 
 int
 main(int argc, char *argv[], const char *const *envp)
 {
+	struct conn *c;
+
 	parse_options(argc, argv);
+	simd_init();
+	fieldtab_init();
 
-	cwd = open(".", O_RDONLY);
+	cwd = open(".", O_RDONLY | O_CLOEXEC);
+
+	if (zcache_dir && zcache_init(zcache_dir, zcache_max)) {
+		fprintf(stderr, "%s: %s\n", zcache_dir, strerror(errno));
+		exit(69);
+	}
 
 	signal(SIGPIPE, SIG_IGN);
-	get_ucspi_env();
 
-	while (1) {
-		handle_request();
-		if (!keepalive) {
-			break;
-		}
-		if (-1 == fchdir(cwd)) {
-			break;
-		}
+	/*
+	 * Before the workers fork, so they all count in the same place
+	 */
+	if (dostats && stats_init()) {
+		fprintf(stderr, "Unable to keep statistics: %m\n");
+		exit(69);
+	}
+
+	if (listen_addr) {
+		listener();
 	}
 
+	c = conn_new(0, 1);
+	get_ucspi_env(c);
+	serve_connection(c);
+	finish_request(c);
+
 	return 0;
 }
@@ -0,0 +1,530 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+#include "fcache.h"
+
+/*
+ * Open files and what we know about them, keyed by path
+ * ("./vhost/path/file"), so a hot file costs no system calls to find.
+ *
+ * Every directory on the way to a cached file gets an inotify watch,
+ * and a thread reading the inotify fd throws out anything under
+ * whatever changed.  Entries that are in use when they get thrown out
+ * stick around until their last user lets go.
+ *
+ * inotify doesn't see everything (NFS, for one), so a file's size and
+ * mtime also get checked against its fd, at most once a second.
+ *
+ * Small files can carry their whole response around with them.
+ * Those count against maxbytes, and the least recently used entries
+ * go when it's exceeded.
+ */
+
+#define WATCH_MASK (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | \
+                    IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+#define FCACHE_STACK_SIZE (64 * 1024)
+
+static int enabled = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct fentry lru = { .prev = &lru, .next = &lru };
+static struct fentry **buckets;
+static size_t nbuckets;
+static size_t count, max;
+static size_t bytes, maxbytes;
+
+static int ifd = -1;
+static struct watch {
+    int wd;
+    char *path;
+} *watches;
+static size_t nwatches, watchsize;
+
+static unsigned int
+hash(const char *key)
+{
+    unsigned int h = 2166136261u;
+
+    for (; *key; key += 1) {
+        h = (h ^ (unsigned char) *key) * 16777619u;
+    }
+    return h;
+}
+
+static void
+entry_free(struct fentry *e)
+{
+    close(e->fd);
+    if (e->zfd >= 0) {
+        close(e->zfd);
+    }
+    free(e->resp);
+    free(e);
+}
+
+static void
+evict(struct fentry *e)
+{
+    struct fentry **p;
+
+    for (p = &buckets[e->hash & (nbuckets - 1)]; *p != e; p = &(*p)->hnext);
+    *p = e->hnext;
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+    count -= 1;
+    if (e->resp) {
+        bytes -= e->resp->len;
+    }
+
+    if (e->refs) {
+        e->dead = 1;
+    } else {
+        entry_free(e);
+    }
+}
+
+/*
+ * Throw out key, and everything under it if it's a directory
+ */
+static void
+evict_under(const char *key)
+{
+    size_t len = strlen(key);
+    struct fentry *e, *next;
+
+    for (e = lru.next; e != &lru; e = next) {
+        next = e->next;
+        if (!strncmp(e->key, key, len) && ((e->key[len] == 0) || (e->key[len] == '/'))) {
+            evict(e);
+        }
+    }
+}
+
+static void
+evict_all(void)
+{
+    while (lru.next != &lru) {
+        evict(lru.next);
+    }
+}
+
+/*
+ * Make sure changes to dir get noticed
+ */
+static int
+watch(const char *dir)
+{
+    struct watch *w;
+    size_t i;
+    int wd;
+
+    for (i = 0; i < nwatches; i += 1) {
+        if (!strcmp(watches[i].path, dir)) {
+            return 0;
+        }
+    }
+
+    if (nwatches == watchsize) {
+        size_t n = watchsize ? watchsize * 2 : 64;
+
+        if (!(w = realloc(watches, n * sizeof *w))) {
+            return -1;
+        }
+        watches = w;
+        watchsize = n;
+    }
+
+    /*
+     * A directory that's reachable two ways (symlinks) gets
+     * one wd and two entries here, which is fine
+     */
+    wd = inotify_add_watch(ifd, dir, WATCH_MASK);
+    if (-1 == wd) {
+        return -1;
+    }
+    w = &watches[nwatches];
+    if (!(w->path = strdup(dir))) {
+        return -1;
+    }
+    w->wd = wd;
+    nwatches += 1;
+    return 0;
+}
+
+/*
+ * Watch every directory between key and the top
+ */
+static int
+watch_parents(const char *key)
+{
+    char dir[PATH_MAX];
+    char *p;
+
+    if (snprintf(dir, sizeof dir, "%s", key) >= sizeof dir) {
+        return -1;
+    }
+    while ((p = strrchr(dir, '/'))) {
+        *p = 0;
+        if (watch(dir)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void
+handle_event(struct inotify_event *ev)
+{
+    char key[PATH_MAX];
+    size_t i;
+
+    if (ev->mask & IN_Q_OVERFLOW) {
+        evict_all();
+        return;
+    }
+
+    for (i = 0; i < nwatches; i += 1) {
+        struct watch *w = &watches[i];
+
+        if (w->wd != ev->wd) {
+            continue;
+        }
+        if (ev->len) {
+            char *dot;
+
+            snprintf(key, sizeof key, "%s/%s", w->path, ev->name);
+            evict_under(key);
+
+            /*
+             * "file.gz" coming or going changes what we know about "file"
+             */
+            if ((dot = strrchr(key, '.')) && (dot > key + strlen(w->path) + 1)) {
+                *dot = 0;
+                evict_under(key);
+            }
+
+            /*
+             * "dir/" is a stand-in for dir/index.html
+             */
+            snprintf(key, sizeof key, "%s/", w->path);
+            evict_under(key);
+        } else {
+            evict_under(w->path);
+        }
+    }
+
+    if (ev->mask & IN_IGNORED) {
+        for (i = 0; i < nwatches;) {
+            if (watches[i].wd == ev->wd) {
+                free(watches[i].path);
+                watches[i] = watches[--nwatches];
+            } else {
+                i += 1;
+            }
+        }
+    }
+}
+
+static void *
+fcache_thread(void *arg)
+{
+    char buf[8192] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+    while (1) {
+        ssize_t len = read(ifd, buf, sizeof buf);
+        char *p;
+
+        if (len < 1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return NULL;
+        }
+        pthread_mutex_lock(&lock);
+        for (p = buf; p < buf + len;) {
+            struct inotify_event *ev = (struct inotify_event *) p;
+
+            handle_event(ev);
+            p += sizeof *ev + ev->len;
+        }
+        pthread_mutex_unlock(&lock);
+    }
+
+    return NULL;
+}
+
+/*
+ * Start caching up to n files.
+ *
+ * Returns -1 if it couldn't, and everything carries on uncached.
+ */
+int
+fcache_init(size_t n, size_t nbytes)
+{
+    pthread_attr_t attr;
+    pthread_t t;
+    sigset_t all, omask;
+    int ret;
+
+    if (0 == n) {
+        return 0;
+    }
+
+    for (nbuckets = 16; nbuckets < n; nbuckets *= 2);
+    buckets = calloc(nbuckets, sizeof *buckets);
+    if (!buckets) {
+        return -1;
+    }
+    ifd = inotify_init1(IN_CLOEXEC);
+    if (-1 == ifd) {
+        return -1;
+    }
+
+    /*
+     * The thread gets no signals: they're for whoever is serving
+     */
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, FCACHE_STACK_SIZE);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &omask);
+    ret = pthread_create(&t, &attr, fcache_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &omask, NULL);
+    pthread_attr_destroy(&attr);
+    if (ret) {
+        close(ifd);
+        return -1;
+    }
+
+    max = n;
+    maxbytes = nbytes;
+    enabled = 1;
+    return 0;
+}
+
+/*
+ * In a child process the thread is gone and the lock might be held.
+ * Leave it all alone.
+ */
+void
+fcache_forked(void)
+{
+    enabled = 0;
+}
+
+/*
+ * Look up key.
+ * Returns a reference the caller has to fcache_release(), or NULL.
+ */
+struct fentry *
+fcache_get(const char *key)
+{
+    unsigned int h;
+    struct fentry *e;
+
+    if (!enabled) {
+        return NULL;
+    }
+
+    h = hash(key);
+    pthread_mutex_lock(&lock);
+    for (e = buckets[h & (nbuckets - 1)]; e; e = e->hnext) {
+        if ((e->hash == h) && !strcmp(e->key, key)) {
+            e->refs += 1;
+            e->prev->next = e->next;
+            e->next->prev = e->prev;
+            e->next = lru.next;
+            e->prev = &lru;
+            lru.next->prev = e;
+            lru.next = e;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    if (e && S_ISREG(e->st.st_mode)) {
+        time_t now = time(NULL);
+
+        if (__atomic_load_n(&e->checked, __ATOMIC_RELAXED) != now) {
+            struct stat st;
+
+            if (fstat(e->fd, &st) || (st.st_size != e->st.st_size) || (st.st_mtime != e->st.st_mtime)) {
+                pthread_mutex_lock(&lock);
+                if (!e->dead) {
+                    evict(e);
+                }
+                pthread_mutex_unlock(&lock);
+                fcache_release(e);
+                return NULL;
+            }
+            __atomic_store_n(&e->checked, now, __ATOMIC_RELAXED);
+        }
+    }
+
+    return e;
+}
+
+/*
+ * Hand fd over to the cache as key.  st can be NULL if nobody needs it.
+ * variants is whatever the caller wants to remember about its
+ * compressed copies.
+ *
+ * Returns a reference like fcache_get().
+ * If it returns NULL, fd still belongs to the caller.
+ */
+struct fentry *
+fcache_add(const char *key, int fd, const struct stat *st, const char *type, int variants)
+{
+    size_t keylen = strlen(key);
+    unsigned int h;
+    struct fentry *e;
+
+    if (!enabled) {
+        return NULL;
+    }
+
+    h = hash(key);
+    pthread_mutex_lock(&lock);
+    for (e = buckets[h & (nbuckets - 1)]; e; e = e->hnext) {
+        if ((e->hash == h) && !strcmp(e->key, key)) {
+            /*
+             * Somebody beat us to it
+             */
+            pthread_mutex_unlock(&lock);
+            return NULL;
+        }
+    }
+    if (watch_parents(key) || !(e = calloc(1, sizeof *e + keylen + 1))) {
+        pthread_mutex_unlock(&lock);
+        return NULL;
+    }
+
+    e->fd = fd;
+    if (st) {
+        struct tm tm;
+
+        e->st = *st;
+        e->checked = time(NULL);
+        gmtime_r(&st->st_mtime, &tm);
+        strftime(e->lastmod, sizeof e->lastmod, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    }
+    e->type = type;
+    e->variants = variants;
+    e->zfd = -1;
+    e->hash = h;
+    e->refs = 1;
+    memcpy(e->key, key, keylen + 1);
+
+    e->hnext = buckets[h & (nbuckets - 1)];
+    buckets[h & (nbuckets - 1)] = e;
+    e->next = lru.next;
+    e->prev = &lru;
+    lru.next->prev = e;
+    lru.next = e;
+    count += 1;
+
+    while (count > max) {
+        evict(lru.prev);
+    }
+    pthread_mutex_unlock(&lock);
+
+    return e;
+}
+
+/*
+ * Attach a response to e, which takes it over.
+ * Returns -1 if e already has one (or is on its way out),
+ * and resp still belongs to the caller.
+ */
+int
+fcache_set_resp(struct fentry *e, struct fresp *resp)
+{
+    if (!enabled || (resp->len > maxbytes)) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&lock);
+    if (e->resp || e->dead) {
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    __atomic_store_n(&e->resp, resp, __ATOMIC_RELEASE);
+    bytes += resp->len;
+    while (bytes > maxbytes) {
+        evict(lru.prev);
+    }
+    pthread_mutex_unlock(&lock);
+
+    return 0;
+}
+
+/*
+ * e's response, if it has one yet.
+ * It lasts as long as the reference to e.
+ */
+struct fresp *
+fcache_resp(struct fentry *e)
+{
+    return __atomic_load_n(&e->resp, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Hang on to a compressed copy of e (or the news that there isn't one,
+ * if zfd is negative), which e takes over.
+ * Returns -1 if e already has one (or is on its way out),
+ * and zfd still belongs to the caller.
+ */
+int
+fcache_set_zfd(struct fentry *e, int zfd, off_t zlen)
+{
+    if (!enabled) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&lock);
+    if ((e->zfd != -1) || e->dead) {
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    e->zlen = zlen;
+    __atomic_store_n(&e->zfd, zfd, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&lock);
+
+    return 0;
+}
+
+/*
+ * e's compressed copy, and its length in *zlen.
+ * -1 if nobody's said yet; the fd lasts as long as the reference to e.
+ */
+int
+fcache_zfd(struct fentry *e, off_t *zlen)
+{
+    int zfd = __atomic_load_n(&e->zfd, __ATOMIC_ACQUIRE);
+
+    *zlen = e->zlen;
+    return zfd;
+}
+
+void
+fcache_release(struct fentry *e)
+{
+    if (!enabled) {
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    e->refs -= 1;
+    if (e->dead && (0 == e->refs)) {
+        entry_free(e);
+    }
+    pthread_mutex_unlock(&lock);
+}
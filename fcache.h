@@ -0,0 +1,53 @@
+#ifndef __FCACHE_H__
+#define __FCACHE_H__
+
+#include <sys/stat.h>
+
+/*
+ * A complete response for a small file: header block, then the file.
+ * The status line and Connection field only fit a request with the
+ * same http_version and keepalive; the rest fits anybody.
+ */
+struct fresp {
+    size_t len;
+    size_t fields;              /* where the fields after Connection start */
+    size_t body;                /* where the file starts */
+    int http_version, keepalive;
+    int encoding;               /* which compressed copy, or -1 */
+    char data[];
+};
+
+/*
+ * An open file the cache is hanging on to, and what we know about it.
+ * Everything but the bookkeeping is read-only once it's in the cache.
+ */
+struct fentry {
+    int fd;
+    struct stat st;
+    const char *type;           /* MIME type, or NULL */
+    char lastmod[40];           /* Last-Modified, or "" */
+    int variants;               /* compressed copies next to it, a mask */
+    int zfd;                    /* use fcache_zfd() */
+    off_t zlen;
+    struct fresp *resp;         /* use fcache_resp() */
+    time_t checked;             /* when st was last known to be right */
+
+    struct fentry *prev, *next; /* LRU list */
+    struct fentry *hnext;       /* hash chain */
+    unsigned int hash;
+    int refs;
+    int dead;                   /* evicted, free at last release */
+    char key[];
+};
+
+int fcache_init(size_t max, size_t maxbytes);
+void fcache_forked(void);
+struct fentry *fcache_get(const char *key);
+struct fentry *fcache_add(const char *key, int fd, const struct stat *st, const char *type, int variants);
+int fcache_set_resp(struct fentry *e, struct fresp *resp);
+struct fresp *fcache_resp(struct fentry *e);
+int fcache_set_zfd(struct fentry *e, int zfd, off_t zlen);
+int fcache_zfd(struct fentry *e, off_t *zlen);
+void fcache_release(struct fentry *e);
+
+#endif
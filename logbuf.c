@@ -0,0 +1,258 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <limits.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include "logbuf.h"
+
+/*
+ * Log lines on their way to stderr.
+ *
+ * Until logbuf_init(), every line is one write(), right away: a
+ * process serving one connection can be killed by its alarm at
+ * any moment, and shouldn't take lines with it.
+ *
+ * After it, lines pile up in a buffer, and a thread writes the pile
+ * out once it passes LOG_BATCH, or every second, whichever comes first.
+ * Whatever is reading stderr (multilog, a pipe that's full) can take
+ * its time without holding up a request.  If the writer gets more than
+ * LOG_MAX behind, lines are thrown away, and it says how many.
+ *
+ * The thread takes SIGTERM for the process, so it can write out
+ * the last of the pile before going.  It only lets SIGTERM in while
+ * it's waiting, so there's no missing one between looking and waiting.
+ */
+
+#define LOG_BATCH (32 * 1024)
+#define LOG_MAX (4 * 1024 * 1024)
+#define LOG_STACK_SIZE (64 * 1024)
+
+static int async = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int efd = -1;          /* wakes the thread up early */
+static sigset_t waitmask;       /* the thread's, with SIGTERM let in */
+static char *buf;
+static size_t len, size;
+static unsigned long dropped;
+static volatile sig_atomic_t stopping = 0;
+static sigset_t term;
+
+static void
+write_all(const char *p, size_t n)
+{
+    while (n) {
+        ssize_t ret = write(2, p, n);
+
+        if (ret < 1) {
+            if ((-1 == ret) && (errno == EINTR)) {
+                continue;
+            }
+            return;
+        }
+        p += ret;
+        n -= ret;
+    }
+}
+
+static void
+sigterm(int sig)
+{
+    stopping = 1;
+}
+
+/*
+ * The thread's write: a pipe's worth at a time, so a SIGTERM gets a look
+ * in even when the reader is slow.  After one, the reader gets a couple
+ * of seconds to take the rest, and then we stop waiting for it.
+ */
+static void
+write_out(const char *p, size_t n)
+{
+    time_t give_up = 0;
+
+    while (n) {
+        struct pollfd pfd = { 2, POLLOUT, 0 };
+        struct timespec ts = { 1, 0 };
+        ssize_t ret;
+
+        if (stopping && !give_up) {
+            give_up = time(NULL) + 2;
+        }
+        if (give_up && (time(NULL) >= give_up)) {
+            return;
+        }
+        if (ppoll(&pfd, 1, &ts, &waitmask) < 1) {
+            continue;
+        }
+        ret = write(2, p, (n < PIPE_BUF) ? n : PIPE_BUF);
+        if (ret < 1) {
+            if ((-1 == ret) && ((errno == EINTR) || (errno == EAGAIN))) {
+                continue;
+            }
+            return;
+        }
+        p += ret;
+        n -= ret;
+    }
+}
+
+static void *
+logbuf_thread(void *arg)
+{
+    char *spare = NULL;
+    size_t sparesize = 0;
+
+    pthread_sigmask(SIG_SETMASK, NULL, &waitmask);
+    sigdelset(&waitmask, SIGTERM);
+    while (1) {
+        struct timespec ts = { 1, 0 };
+        struct pollfd pfd = { efd, POLLIN, 0 };
+        char *out;
+        size_t outlen, outsize;
+        unsigned long lost;
+        uint64_t n;
+
+        if (!stopping && (ppoll(&pfd, 1, &ts, &waitmask) > 0)) {
+            read(efd, &n, sizeof n);
+        }
+
+        pthread_mutex_lock(&lock);
+        out = buf;
+        outlen = len;
+        outsize = size;
+        lost = dropped;
+        buf = spare;
+        size = sparesize;
+        len = 0;
+        dropped = 0;
+        pthread_mutex_unlock(&lock);
+
+        write_out(out, outlen);
+        if (lost) {
+            char msg[80];
+
+            write_out(msg, snprintf(msg, sizeof msg, "%lu log lines dropped: stderr is too slow\n", lost));
+        }
+        spare = out;
+        sparesize = outsize;
+        if (stopping) {
+            _exit(0);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Start batching lines, for a process that's going to be around a while.
+ *
+ * Returns -1 if it couldn't, and lines carry on going out one at a time.
+ */
+int
+logbuf_init(void)
+{
+    pthread_attr_t attr;
+    pthread_t t;
+    struct sigaction sa;
+    sigset_t all, omask;
+    int ret;
+
+    /*
+     * Everybody but the thread leaves SIGTERM to the thread,
+     * and the thread leaves everything else to everybody else
+     */
+    efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (-1 == efd) {
+        return -1;
+    }
+    sigemptyset(&term);
+    sigaddset(&term, SIGTERM);
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = sigterm;
+    sigaction(SIGTERM, &sa, NULL);
+    pthread_sigmask(SIG_BLOCK, &term, NULL);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, LOG_STACK_SIZE);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &omask);
+    ret = pthread_create(&t, &attr, logbuf_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &omask, NULL);
+    pthread_attr_destroy(&attr);
+    if (ret) {
+        close(efd);
+        signal(SIGTERM, SIG_DFL);
+        pthread_sigmask(SIG_UNBLOCK, &term, NULL);
+        errno = ret;
+        return -1;
+    }
+
+    async = 1;
+    return 0;
+}
+
+/*
+ * In a child process the thread is gone and the lock might be held.
+ * What's in the buffer is the parent's to write; the child writes its
+ * own lines directly, and SIGTERM goes back to killing it.
+ */
+void
+logbuf_forked(void)
+{
+    if (async) {
+        async = 0;
+        signal(SIGTERM, SIG_DFL);
+        pthread_sigmask(SIG_UNBLOCK, &term, NULL);
+    }
+}
+
+void
+logbuf_write(const char *line, size_t n)
+{
+    int wake = 0;
+
+    if (!async) {
+        write_all(line, n);
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    if (len + n > LOG_MAX) {
+        dropped += 1;
+    } else {
+        if (len + n > size) {
+            size_t newsize = size ? size : LOG_BATCH * 2;
+            char *p;
+
+            while (newsize < len + n) {
+                newsize *= 2;
+            }
+            if (!(p = realloc(buf, newsize))) {
+                dropped += 1;
+                pthread_mutex_unlock(&lock);
+                return;
+            }
+            buf = p;
+            size = newsize;
+        }
+        memcpy(buf + len, line, n);
+        len += n;
+        wake = (len >= LOG_BATCH) && (len - n < LOG_BATCH);
+    }
+    pthread_mutex_unlock(&lock);
+
+    if (wake) {
+        uint64_t one = 1;
+
+        write(efd, &one, sizeof one);
+    }
+}
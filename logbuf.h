@@ -0,0 +1,10 @@
+#ifndef __LOGBUF_H__
+#define __LOGBUF_H__
+
+#include <stddef.h>
+
+int logbuf_init(void);
+void logbuf_forked(void);
+void logbuf_write(const char *line, size_t len);
+
+#endif
@@ -1,51 +1,141 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
 #include "mime.h"
-
-static struct mimeentry {
-    const char     *name,
-                   *type;
-} mimetab[] = {
-    {
-    "html", "text/html; charset=UTF-8"}, {
-    "htm", "text/html; charset=UTF-8"}, {
-    "txt", "text/plain; charset=UTF-8"}, {
-    "css", "text/css"}, {
-    "ps", "application/postscript"}, {
-    "pdf", "application/pdf"}, {
-    "js", "application/javascript"}, {
-    "gif", "image/gif"}, {
-    "png", "image/png"}, {
-    "jpeg", "image/jpeg"}, {
-    "jpg", "image/jpeg"}, {
-    "svg", "image/svg+xml"}, {
-	"webm", "video/webm"}, {
-    "mpeg", "video/mpeg"}, {
-    "mpg", "video/mpeg"}, {
-    "avi", "video/x-msvideo"}, {
-    "mov", "video/quicktime"}, {
-    "qt", "video/quicktime"}, {
-    "mp3", "audio/mpeg"}, {
-    "ogg", "audio/ogg"}, {
-    "wav", "audio/x-wav"}, {
-    "epub", "application/epub+zip"}, {
-    "dvi", "application/x-dvi"}, {
-    "pac", "application/x-ns-proxy-autoconfig"}, {
-    "sig", "application/pgp-signature"}, {
-    "swf", "application/x-shockwave-flash"}, {
-    "torrent", "application/x-bittorrent"}, {
-    "tar", "application/x-tar"}, {
-    "zip", "application/zip"}, {
-    "dtd", "text/xml"}, {
-    "xml", "text/xml"}, {
-    "xbm", "image/x-xbitmap"}, {
-    "xpm", "image/x-xpixmap"}, {
-    "xwd", "image/x-xwindowdump"}, {
-    "ico", "image/x-icon"}, {
-    0, 0}};
+#include "mimetab.h"
+#include "mimehash.h"
 
 static const char *default_mimetype = "application/octet-stream";
 
+/*
+ * Types loaded from a mime.types file, open-addressed.
+ * Filled in once at startup, read-only after that.
+ */
+static struct mimeentry *loaded;
+static size_t loaded_slots;
+
+static const char *
+loaded_lookup(const char *ext)
+{
+    size_t i;
+
+    if (!loaded) {
+        return NULL;
+    }
+    for (i = mimehash_fn(ext, 0); loaded[i & (loaded_slots - 1)].name; i += 1) {
+        struct mimeentry *e = &loaded[i & (loaded_slots - 1)];
+
+        if (!strcasecmp(e->name, ext)) {
+            return e->type;
+        }
+    }
+    return NULL;
+}
+
+static int
+loaded_insert(char *ext, const char *type)
+{
+    size_t i;
+    char *p;
+
+    for (p = ext; *p; p += 1) {
+        *p = tolower((unsigned char) *p);
+    }
+    for (i = mimehash_fn(ext, 0); loaded[i & (loaded_slots - 1)].name; i += 1) {
+        if (!strcmp(loaded[i & (loaded_slots - 1)].name, ext)) {
+            /*
+             * First one wins, like everybody else does it
+             */
+            return 0;
+        }
+    }
+    if (!(ext = strdup(ext))) {
+        return -1;
+    }
+    loaded[i & (loaded_slots - 1)].name = ext;
+    loaded[i & (loaded_slots - 1)].type = type;
+    return 0;
+}
+
+/*
+ * Load a mime.types file: "type ext ext ..." per line, # comments.
+ * These take precedence over the built-in types.
+ *
+ * Returns -1 with errno set if something went wrong.
+ */
+int
+mime_load(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    char line[1024];
+    size_t n = 0;
+
+    if (!f) {
+        return -1;
+    }
+
+    /*
+     * Count extensions first, so the table only gets sized once
+     */
+    while (fgets(line, sizeof line, f)) {
+        char *tok = strtok(line, " \t\r\n");
+
+        if (tok && (*tok != '#')) {
+            while (strtok(NULL, " \t\r\n")) {
+                n += 1;
+            }
+        }
+    }
+    for (loaded_slots = 16; loaded_slots < n * 2; loaded_slots *= 2);
+    loaded = calloc(loaded_slots, sizeof *loaded);
+    if (!loaded) {
+        fclose(f);
+        return -1;
+    }
+
+    rewind(f);
+    while (fgets(line, sizeof line, f)) {
+        char *type = strtok(line, " \t\r\n");
+        char *ext;
+
+        if (!type || (*type == '#')) {
+            continue;
+        }
+        ext = strtok(NULL, " \t\r\n");
+        if (!ext) {
+            continue;
+        }
+        if (!strncmp(type, "text/", 5) && !strchr(type, ';')) {
+            /*
+             * Same as the built-in text types
+             */
+            char *t = malloc(strlen(type) + sizeof "; charset=UTF-8");
+
+            if (t) {
+                sprintf(t, "%s; charset=UTF-8", type);
+            }
+            type = t;
+        } else {
+            type = strdup(type);
+        }
+        if (!type) {
+            fclose(f);
+            return -1;
+        }
+        for (; ext; ext = strtok(NULL, " \t\r\n")) {
+            if (loaded_insert(ext, type)) {
+                fclose(f);
+                return -1;
+            }
+        }
+    }
+    fclose(f);
+
+    return 0;
+}
+
 /*
  * Determine MIME type from file extension
  */
@@ -53,18 +143,34 @@ const char *
 getmimetype(char *url)
 {
     char *ext = strrchr(url, '.');
-
+    const char *type;
 
     if (ext) {
-        int             i;
+        const struct mimeentry *e;
+        unsigned char i;
 
         ext++;
-        for (i = 0; mimetab[i].name; ++i) {
-            if (!strcmp(mimetab[i].name, ext)) {
-                return mimetab[i].type;
+        if ((type = loaded_lookup(ext))) {
+            return type;
+        }
+        i = mimehash[mimehash_fn(ext, MIMEHASH_SEED) % MIMEHASH_SLOTS];
+        if (i < MIMETAB_LEN) {
+            e = &mimetab[i];
+            if (!strcasecmp(e->name, ext)) {
+                return e->type;
             }
         }
     }
     return default_mimetype;
 }
 
+/*
+ * Is type worth compressing?  Text, and things that are text
+ * underneath; most everything else already is compressed.
+ */
+int
+mime_compressible(const char *type)
+{
+    return !strncmp(type, "text/", 5) || strstr(type, "javascript") || strstr(type, "json")
+        || strstr(type, "xml") || strstr(type, "wasm") || strstr(type, "postscript");
+}
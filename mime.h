@@ -2,5 +2,7 @@
 #define __MIME_H__
 
 const char *getmimetype(char *url);
+int mime_load(const char *path);
+int mime_compressible(const char *type);
 
 #endif
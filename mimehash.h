@@ -0,0 +1,21 @@
+/* Generated by mkmimehash; do not edit */
+#define MIMEHASH_SEED 2166136406u
+#define MIMEHASH_SLOTS 256
+static const unsigned char mimehash[MIMEHASH_SLOTS] = {
+    255, 255, 255, 36, 255, 255, 25, 38, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 13, 255, 255, 255, 255, 255, 24, 255, 255, 255, 255, 37, 255, 255, 255,
+    255, 255, 255, 53, 255, 255, 255, 255, 255, 255, 4, 255, 255, 52, 35, 14,
+    255, 255, 255, 255, 255, 255, 255, 15, 255, 255, 255, 255, 255, 255, 50, 255,
+    255, 255, 16, 255, 255, 255, 23, 255, 255, 39, 8, 255, 43, 255, 255, 255,
+    255, 255, 255, 11, 255, 51, 18, 255, 255, 255, 255, 255, 255, 255, 255, 29,
+    255, 255, 255, 3, 6, 255, 255, 255, 255, 49, 255, 255, 20, 255, 40, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 28, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 5, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 33, 255, 255, 255, 255, 255, 255, 255, 46, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 34, 255, 255, 255, 31, 255, 255, 42,
+    255, 255, 255, 12, 255, 255, 255, 255, 255, 255, 1, 27, 255, 255, 255, 0,
+    255, 255, 255, 255, 255, 9, 255, 255, 255, 255, 255, 255, 19, 255, 255, 21,
+    255, 255, 44, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 30, 255, 255, 255, 48, 47, 255, 255, 255, 255, 255, 255, 45, 10, 32,
+    255, 26, 255, 255, 255, 41, 255, 255, 17, 2, 255, 255, 255, 255, 7, 22,
+};
@@ -0,0 +1,93 @@
+#ifndef __MIMETAB_H__
+#define __MIMETAB_H__
+
+#include <ctype.h>
+
+/*
+ * Built-in MIME types.
+ *
+ * mkmimehash finds a seed that gives every extension here its own slot,
+ * so getmimetype() never has to probe.
+ * Extensions are lowercase.
+ */
+static const struct mimeentry {
+    const char     *name,
+                   *type;
+} mimetab[] = {
+    {"html", "text/html; charset=UTF-8"},
+    {"htm", "text/html; charset=UTF-8"},
+    {"txt", "text/plain; charset=UTF-8"},
+    {"md", "text/markdown; charset=UTF-8"},
+    {"csv", "text/csv; charset=UTF-8"},
+    {"css", "text/css"},
+    {"js", "application/javascript"},
+    {"mjs", "application/javascript"},
+    {"json", "application/json"},
+    {"map", "application/json"},
+    {"wasm", "application/wasm"},
+    {"ps", "application/postscript"},
+    {"pdf", "application/pdf"},
+    {"gif", "image/gif"},
+    {"png", "image/png"},
+    {"apng", "image/apng"},
+    {"jpeg", "image/jpeg"},
+    {"jpg", "image/jpeg"},
+    {"webp", "image/webp"},
+    {"avif", "image/avif"},
+    {"svg", "image/svg+xml"},
+    {"ico", "image/x-icon"},
+    {"xbm", "image/x-xbitmap"},
+    {"xpm", "image/x-xpixmap"},
+    {"xwd", "image/x-xwindowdump"},
+    {"woff", "font/woff"},
+    {"woff2", "font/woff2"},
+    {"ttf", "font/ttf"},
+    {"otf", "font/otf"},
+    {"webm", "video/webm"},
+    {"mp4", "video/mp4"},
+    {"m4v", "video/mp4"},
+    {"mpeg", "video/mpeg"},
+    {"mpg", "video/mpeg"},
+    {"avi", "video/x-msvideo"},
+    {"mov", "video/quicktime"},
+    {"qt", "video/quicktime"},
+    {"mp3", "audio/mpeg"},
+    {"m4a", "audio/mp4"},
+    {"ogg", "audio/ogg"},
+    {"opus", "audio/ogg"},
+    {"flac", "audio/flac"},
+    {"wav", "audio/x-wav"},
+    {"epub", "application/epub+zip"},
+    {"dvi", "application/x-dvi"},
+    {"pac", "application/x-ns-proxy-autoconfig"},
+    {"sig", "application/pgp-signature"},
+    {"swf", "application/x-shockwave-flash"},
+    {"torrent", "application/x-bittorrent"},
+    {"tar", "application/x-tar"},
+    {"gz", "application/gzip"},
+    {"zip", "application/zip"},
+    {"dtd", "text/xml"},
+    {"xml", "text/xml"},
+};
+
+#define MIMETAB_LEN (sizeof mimetab / sizeof *mimetab)
+
+/*
+ * Case-insensitive FNV-1a, with a finalizer so the low bits
+ * depend on the whole seed.
+ */
+static inline unsigned int
+mimehash_fn(const char *ext, unsigned int seed)
+{
+    unsigned int h = seed;
+
+    for (; *ext; ext += 1) {
+        h = (h ^ (unsigned char) tolower((unsigned char) *ext)) * 16777619u;
+    }
+    h ^= h >> 15;
+    h *= 0x2c1b3c6du;
+    h ^= h >> 12;
+    return h;
+}
+
+#endif
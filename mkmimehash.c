@@ -0,0 +1,44 @@
+#include <stdio.h>
+#include <string.h>
+#include "mimetab.h"
+
+/*
+ * Print mimehash.h: a seed and slot table making mimehash_fn()
+ * a perfect hash over the built-in MIME types.
+ */
+
+#define SLOTS 256
+
+int
+main(void)
+{
+    unsigned char slot[SLOTS];
+    unsigned int seed;
+    size_t i;
+
+    for (seed = 2166136261u;; seed += 1) {
+        memset(slot, 0xff, sizeof slot);
+        for (i = 0; i < MIMETAB_LEN; i += 1) {
+            unsigned int s = mimehash_fn(mimetab[i].name, seed) % SLOTS;
+
+            if (slot[s] != 0xff) {
+                break;
+            }
+            slot[s] = i;
+        }
+        if (i == MIMETAB_LEN) {
+            break;
+        }
+    }
+
+    printf("/* Generated by mkmimehash; do not edit */\n");
+    printf("#define MIMEHASH_SEED %uu\n", seed);
+    printf("#define MIMEHASH_SLOTS %d\n", SLOTS);
+    printf("static const unsigned char mimehash[MIMEHASH_SLOTS] = {");
+    for (i = 0; i < SLOTS; i += 1) {
+        printf("%s%d,", (i % 16) ? " " : "\n    ", slot[i]);
+    }
+    printf("\n};\n");
+
+    return 0;
+}
@@ -0,0 +1,53 @@
+#! /bin/sh
+
+## Make .gz (and .br, .zst, if you have the tools) copies
+## of the compressible files under a document root,
+## for eris to send to clients that take them.
+##
+## Only missing or out of date copies get made.
+## A copy that isn't smaller than the original is thrown out.
+
+: ${MINSIZE:=256}
+
+have () {
+    command -v "$1" >/dev/null 2>&1
+}
+
+# squeeze FILE EXT COMMAND...
+squeeze () {
+    f=$1; ext=$2; shift 2
+
+    if [ -e "$f$ext" ] && ! [ "$f" -nt "$f$ext" ]; then
+        return 0
+    fi
+    "$@" < "$f" > "$f$ext.tmp" || { rm -f "$f$ext.tmp"; return 1; }
+    if [ $(wc -c < "$f$ext.tmp") -lt $(wc -c < "$f") ]; then
+        touch -r "$f" "$f$ext.tmp"
+        mv "$f$ext.tmp" "$f$ext"
+    else
+        rm -f "$f$ext.tmp" "$f$ext"
+    fi
+}
+
+## find hands the names back to us as arguments,
+## so any name at all (newlines and all) comes through intact
+if [ "$1" = "--files" ]; then
+    shift
+    for f in "$@"; do
+        squeeze "$f" .gz gzip -9 -n
+        have brotli && squeeze "$f" .br brotli -c -q 11
+        have zstd && squeeze "$f" .zst zstd -q -19 -c
+    done
+    exit 0
+fi
+
+if [ $# -lt 1 ]; then
+    echo "Usage: $0 DOCROOT..." 1>&2
+    exit 1
+fi
+
+find "$@" -type f -size +${MINSIZE}c \( \
+    -name '*.html' -o -name '*.htm' -o -name '*.css' -o -name '*.js' -o -name '*.mjs' \
+    -o -name '*.json' -o -name '*.xml' -o -name '*.svg' -o -name '*.txt' -o -name '*.csv' \
+    -o -name '*.md' -o -name '*.wasm' -o -name '*.map' \
+    \) -exec sh "$0" --files {} +
@@ -0,0 +1,212 @@
+#include <string.h>
+#include "simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+/*
+ * RFC 7230 tchar
+ */
+static int
+tchar(int ch)
+{
+    switch (ch) {
+        case 'a'...'z':
+        case 'A'...'Z':
+        case '0'...'9':
+            return 1;
+    }
+    return ch && strchr("!#$%&'*+-.^_`|~", ch);
+}
+
+static int
+tchars(const char *p, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i += 1) {
+        if (!tchar((unsigned char) p[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static size_t
+find_delim_scalar(const char *p, size_t len, int a, int b, int c, int d)
+{
+    size_t i;
+
+    for (i = 0; i < len; i += 1) {
+        char ch = p[i];
+
+        if ((ch == a) || (ch == b) || (ch == c) || (ch == d)) {
+            break;
+        }
+    }
+    return i;
+}
+
+static int
+field_name_scalar(char *p, size_t len)
+{
+    int ok = 1;
+    size_t i;
+
+    for (i = 0; i < len; i += 1) {
+        ok &= tchar((unsigned char) p[i]);
+        switch (p[i]) {
+            case 'a'...'z':
+                p[i] ^= ' ';
+                break;
+            case 'A'...'Z':
+            case '0'...'9':
+                break;
+            default:
+                p[i] = '_';
+                break;
+        }
+    }
+    return ok ? 0 : -1;
+}
+
+#ifdef HAVE_X86
+
+/*
+ * Compares are signed, so anything with the high bit set
+ * falls outside every range and ends up as '_'.
+ */
+#define IN_RANGE128(v, lo, hi) \
+    _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8((lo) - 1)), \
+                  _mm_cmplt_epi8(v, _mm_set1_epi8((hi) + 1)))
+
+__attribute__((target("sse2")))
+static size_t
+find_delim_sse2(const char *p, size_t len, int a, int b, int c, int d)
+{
+    __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b);
+    __m128i vc = _mm_set1_epi8(c), vd = _mm_set1_epi8(d);
+    size_t i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (p + i));
+        __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)),
+                                 _mm_or_si128(_mm_cmpeq_epi8(v, vc), _mm_cmpeq_epi8(v, vd)));
+        unsigned bits = _mm_movemask_epi8(m);
+
+        if (bits) {
+            return i + __builtin_ctz(bits);
+        }
+    }
+    return i + find_delim_scalar(p + i, len - i, a, b, c, d);
+}
+
+__attribute__((target("sse2")))
+static int
+field_name_sse2(char *p, size_t len)
+{
+    int ok = 1;
+    size_t i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (p + i));
+        __m128i lower = IN_RANGE128(v, 'a', 'z');
+        __m128i alnum = _mm_or_si128(lower, _mm_or_si128(IN_RANGE128(v, 'A', 'Z'), IN_RANGE128(v, '0', '9')));
+        __m128i out = _mm_xor_si128(v, _mm_and_si128(lower, _mm_set1_epi8(' ')));
+        unsigned other = ~_mm_movemask_epi8(alnum) & 0xffff;
+
+        if (other) {
+            /*
+             * Dashes are the only punctuation anybody really sends
+             */
+            unsigned dash = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('-')));
+
+            if (other & ~dash) {
+                ok &= tchars(p + i, 16);
+            }
+            out = _mm_or_si128(_mm_and_si128(alnum, out), _mm_andnot_si128(alnum, _mm_set1_epi8('_')));
+        }
+        _mm_storeu_si128((__m128i *) (p + i), out);
+    }
+    if (field_name_scalar(p + i, len - i)) {
+        ok = 0;
+    }
+    return ok ? 0 : -1;
+}
+
+#define IN_RANGE256(v, lo, hi) \
+    _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8((lo) - 1)), \
+                     _mm256_cmpgt_epi8(_mm256_set1_epi8((hi) + 1), v))
+
+__attribute__((target("avx2")))
+static size_t
+find_delim_avx2(const char *p, size_t len, int a, int b, int c, int d)
+{
+    __m256i va = _mm256_set1_epi8(a), vb = _mm256_set1_epi8(b);
+    __m256i vc = _mm256_set1_epi8(c), vd = _mm256_set1_epi8(d);
+    size_t i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (p + i));
+        __m256i m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)),
+                                    _mm256_or_si256(_mm256_cmpeq_epi8(v, vc), _mm256_cmpeq_epi8(v, vd)));
+        unsigned bits = _mm256_movemask_epi8(m);
+
+        if (bits) {
+            return i + __builtin_ctz(bits);
+        }
+    }
+    return i + find_delim_sse2(p + i, len - i, a, b, c, d);
+}
+
+__attribute__((target("avx2")))
+static int
+field_name_avx2(char *p, size_t len)
+{
+    int ok = 1;
+    size_t i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (p + i));
+        __m256i lower = IN_RANGE256(v, 'a', 'z');
+        __m256i alnum = _mm256_or_si256(lower, _mm256_or_si256(IN_RANGE256(v, 'A', 'Z'), IN_RANGE256(v, '0', '9')));
+        __m256i out = _mm256_xor_si256(v, _mm256_and_si256(lower, _mm256_set1_epi8(' ')));
+        unsigned other = ~(unsigned) _mm256_movemask_epi8(alnum);
+
+        if (other) {
+            unsigned dash = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('-')));
+
+            if (other & ~dash) {
+                ok &= tchars(p + i, 32);
+            }
+            out = _mm256_or_si256(_mm256_and_si256(alnum, out), _mm256_andnot_si256(alnum, _mm256_set1_epi8('_')));
+        }
+        _mm256_storeu_si256((__m256i *) (p + i), out);
+    }
+    if (field_name_sse2(p + i, len - i)) {
+        ok = 0;
+    }
+    return ok ? 0 : -1;
+}
+
+#endif
+
+size_t (*find_delim)(const char *p, size_t len, int a, int b, int c, int d) = find_delim_scalar;
+int (*field_name)(char *p, size_t len) = field_name_scalar;
+
+void
+simd_init(void)
+{
+#ifdef HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        find_delim = find_delim_avx2;
+        field_name = field_name_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        find_delim = find_delim_sse2;
+        field_name = field_name_sse2;
+    }
+#endif
+}
@@ -0,0 +1,20 @@
+#ifndef __SIMD_H__
+#define __SIMD_H__
+
+#include <stddef.h>
+
+/*
+ * Byte-scanning kernels, picked at startup by simd_init().
+ * Until then, the portable versions are used.
+ */
+
+/* Offset of the first a, b, c or d in p[0..len), or len if there isn't one */
+extern size_t (*find_delim)(const char *p, size_t len, int a, int b, int c, int d);
+
+/* Turn a header field name into CGI style (USER_AGENT), in place.
+ * Returns 0 if every byte was a valid token character, -1 otherwise. */
+extern int (*field_name)(char *p, size_t len);
+
+void simd_init(void);
+
+#endif
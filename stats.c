@@ -0,0 +1,354 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "stats.h"
+
+/*
+ * How long requests spend in each phase, by vhost and status class.
+ *
+ * Histograms have fixed buckets in microseconds: one each for 0 to 3,
+ * then four to every power of two, so a bucket is never more than a
+ * quarter wider than what's in it.  The last one takes everything past
+ * four and a half minutes.
+ *
+ * It all lives in one shared mapping, made before the workers fork,
+ * so every worker (and thread, and CGI-minding child) adds to the same
+ * counts with atomic adds, and any of them can report the lot.
+ * A report taken while requests are going can be a request or two
+ * out between its buckets and its sums.
+ *
+ * Vhosts get a slot the first time one is counted.  Slot 0 is for
+ * requests that never got as far as picking one, and once the rest
+ * are taken, new vhosts share the last.
+ */
+
+#define STATS_SUB 4
+#define STATS_BUCKETS (STATS_SUB + 26 * STATS_SUB)
+#define STATS_CLASSES 6         /* none, 1xx .. 5xx */
+#define STATS_VHOSTS 64
+#define STATS_NAMELEN 64
+
+struct hist {
+    uint64_t sum, max;
+    uint64_t bucket[STATS_BUCKETS];
+};
+
+struct vhost {
+    int state;                  /* 0: free, 1: being claimed, 2: in use */
+    char name[STATS_NAMELEN];
+    struct hist h[STATS_CLASSES][STATS_PHASES];
+};
+
+static struct vhost *vhosts = NULL;
+
+static const char *phase_names[STATS_PHASES] = {
+    "read", "parse", "vhost", "open", "cgi", "header", "send", "total",
+};
+
+static const char *class_names[STATS_CLASSES] = {
+    "-", "1xx", "2xx", "3xx", "4xx", "5xx",
+};
+
+/*
+ * Make the shared counters.  Call before forking anything that counts.
+ */
+int
+stats_init(void)
+{
+    void *p = mmap(NULL, STATS_VHOSTS * sizeof *vhosts, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (MAP_FAILED == p) {
+        return -1;
+    }
+    vhosts = p;
+    strcpy(vhosts[0].name, "-");
+    vhosts[0].state = 2;
+    strcpy(vhosts[STATS_VHOSTS - 1].name, "(other)");
+    vhosts[STATS_VHOSTS - 1].state = 2;
+    return 0;
+}
+
+/*
+ * Nanoseconds from some fixed point, for stamping phases
+ */
+uint64_t
+stats_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * The slot for a vhost, claiming one if this is its first time
+ */
+int
+stats_vhost(const char *name)
+{
+    int i;
+
+    for (i = 1; i < STATS_VHOSTS - 1; i += 1) {
+        struct vhost *v = &vhosts[i];
+        int state = __atomic_load_n(&v->state, __ATOMIC_ACQUIRE);
+
+        if (0 == state) {
+            int expect = 0;
+
+            if (__atomic_compare_exchange_n(&v->state, &expect, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                snprintf(v->name, sizeof v->name, "%s", name);
+                __atomic_store_n(&v->state, 2, __ATOMIC_RELEASE);
+                return i;
+            }
+            state = expect;
+        }
+        while (1 == state) {
+            /*
+             * Somebody else is filling in the name: it's a snprintf away
+             */
+            state = __atomic_load_n(&v->state, __ATOMIC_ACQUIRE);
+        }
+        if (!strncmp(v->name, name, sizeof v->name - 1)) {
+            return i;
+        }
+    }
+    return STATS_VHOSTS - 1;
+}
+
+static int
+bucket_of(uint64_t usec)
+{
+    int k, b;
+
+    if (usec < STATS_SUB) {
+        return usec;
+    }
+    k = 63 - __builtin_clzll(usec);     /* 2 or more */
+    b = STATS_SUB + (k - 2) * STATS_SUB + ((usec >> (k - 2)) & (STATS_SUB - 1));
+    return (b < STATS_BUCKETS) ? b : STATS_BUCKETS - 1;
+}
+
+/*
+ * The biggest value that goes in bucket b
+ */
+static uint64_t
+bucket_top(int b)
+{
+    int k;
+
+    if (b < STATS_SUB) {
+        return b;
+    }
+    b -= STATS_SUB;
+    k = b / STATS_SUB + 2;
+    return ((uint64_t) (STATS_SUB + b % STATS_SUB + 1) << (k - 2)) - 1;
+}
+
+static void
+add(struct hist *h, uint64_t nsec)
+{
+    uint64_t usec = nsec / 1000;
+    uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+    __atomic_add_fetch(&h->bucket[bucket_of(usec)], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->sum, usec, __ATOMIC_RELAXED);
+    while ((usec > max) && !__atomic_compare_exchange_n(&h->max, &max, usec, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/*
+ * Count one request.  stamps[] has when each phase finished, or 0 if
+ * it didn't happen; each phase is timed from the one before it.
+ * Sending is timed up to end, and the total from begin.
+ */
+void
+stats_record(int vhost, int code, uint64_t begin, const uint64_t *stamps, uint64_t end)
+{
+    struct hist *h;
+    uint64_t prev = begin;
+    int class = code / 100;
+    int p;
+
+    if (!vhosts || !begin) {
+        return;
+    }
+    if ((class < 0) || (class >= STATS_CLASSES)) {
+        class = 0;
+    }
+    if ((vhost < 0) || (vhost >= STATS_VHOSTS)) {
+        vhost = 0;
+    }
+    h = vhosts[vhost].h[class];
+
+    for (p = STATS_READ; p < STATS_SEND; p += 1) {
+        if (stamps[p]) {
+            add(&h[p], (stamps[p] > prev) ? stamps[p] - prev : 0);
+            prev = stamps[p];
+        }
+    }
+    if (stamps[STATS_HEADER]) {
+        add(&h[STATS_SEND], (end > prev) ? end - prev : 0);
+    }
+    add(&h[STATS_TOTAL], (end > begin) ? end - begin : 0);
+}
+
+/*
+ * The value below which a fraction q of what's in h falls,
+ * to within a bucket
+ */
+static uint64_t
+quantile(const struct hist *h, uint64_t count, double q)
+{
+    uint64_t want = q * count;
+    uint64_t seen = 0;
+    int b;
+
+    for (b = 0; b < STATS_BUCKETS; b += 1) {
+        seen += h->bucket[b];
+        if (seen > want) {
+            break;
+        }
+    }
+    if (b == STATS_BUCKETS) {
+        b -= 1;
+    }
+    return (bucket_top(b) < h->max) ? bucket_top(b) : h->max;
+}
+
+/*
+ * Label values in the Prometheus format want \ " and newline escaped
+ */
+static void
+label_esc(FILE *f, const char *s)
+{
+    for (; *s; s += 1) {
+        switch (*s) {
+        case '\\':
+        case '"':
+            fputc('\\', f);
+            fputc(*s, f);
+            break;
+        case '\n':
+            fputs("\\n", f);
+            break;
+        default:
+            fputc(*s, f);
+        }
+    }
+}
+
+/*
+ * The start of a Prometheus line for one histogram: name and labels,
+ * with the closing brace left to the caller
+ */
+static void
+series(FILE *f, const char *what, const struct vhost *v, int class, int phase)
+{
+    fprintf(f, "eris_phase_seconds_%s{vhost=\"", what);
+    label_esc(f, v->name);
+    fprintf(f, "\",status=\"%s\",phase=\"%s\"", class_names[class], phase_names[phase]);
+}
+
+static void
+render_prometheus(FILE *f, const struct vhost *v, int class, int phase, const struct hist *h, uint64_t count)
+{
+    uint64_t cum = 0;
+    int b = 0;
+    int k;
+
+    /*
+     * le boundaries just under each power of two, from 1us: those are
+     * the tops of buckets, so each count is exactly what's <= le
+     */
+    for (k = 1; k <= 27; k += 1) {
+        uint64_t le = ((uint64_t) 1 << k) - 1;
+
+        for (; (b < STATS_BUCKETS) && (bucket_top(b) <= le); b += 1) {
+            cum += h->bucket[b];
+        }
+        series(f, "bucket", v, class, phase);
+        fprintf(f, ",le=\"%llu.%06llu\"} %llu\n",
+                (unsigned long long) le / 1000000, (unsigned long long) le % 1000000, (unsigned long long) cum);
+    }
+    series(f, "bucket", v, class, phase);
+    fprintf(f, ",le=\"+Inf\"} %llu\n", (unsigned long long) count);
+    series(f, "sum", v, class, phase);
+    fprintf(f, "} %llu.%06llu\n", (unsigned long long) h->sum / 1000000, (unsigned long long) h->sum % 1000000);
+    series(f, "count", v, class, phase);
+    fprintf(f, "} %llu\n", (unsigned long long) count);
+}
+
+static void
+render_text(FILE *f, const struct vhost *v, int class, int phase, const struct hist *h, uint64_t count)
+{
+    fprintf(f, "%s %s %s %llu %llu %llu %llu %llu %llu\n",
+            v->name, class_names[class], phase_names[phase],
+            (unsigned long long) count,
+            (unsigned long long) (h->sum / count),
+            (unsigned long long) quantile(h, count, 0.5),
+            (unsigned long long) quantile(h, count, 0.9),
+            (unsigned long long) quantile(h, count, 0.99),
+            (unsigned long long) h->max);
+}
+
+/*
+ * Every histogram with anything in it, as plain text (one line each,
+ * in microseconds) or in the Prometheus text exposition format.
+ *
+ * Returns a buffer the caller has to free, or NULL.
+ */
+char *
+stats_render(int prometheus, size_t *len)
+{
+    char *buf = NULL;
+    FILE *f;
+    int i, class, phase;
+
+    if (!vhosts || !(f = open_memstream(&buf, len))) {
+        return NULL;
+    }
+    if (prometheus) {
+        fputs("# HELP eris_phase_seconds Time requests spent in each phase.\n", f);
+        fputs("# TYPE eris_phase_seconds histogram\n", f);
+    } else {
+        fputs("# vhost status phase count mean_us p50_us p90_us p99_us max_us\n", f);
+    }
+    for (i = 0; i < STATS_VHOSTS; i += 1) {
+        const struct vhost *v = &vhosts[i];
+
+        if (__atomic_load_n(&v->state, __ATOMIC_ACQUIRE) != 2) {
+            continue;
+        }
+        for (class = 0; class < STATS_CLASSES; class += 1) {
+            for (phase = 0; phase < STATS_PHASES; phase += 1) {
+                const struct hist *h = &v->h[class][phase];
+                uint64_t count = 0;
+                int b;
+
+                /*
+                 * Counted from the buckets, so the le="+Inf" bucket
+                 * and the count agree with the rest
+                 */
+                for (b = 0; b < STATS_BUCKETS; b += 1) {
+                    count += h->bucket[b];
+                }
+                if (!count) {
+                    continue;
+                }
+                if (prometheus) {
+                    render_prometheus(f, v, class, phase, h, count);
+                } else {
+                    render_text(f, v, class, phase, h, count);
+                }
+            }
+        }
+    }
+    if (fclose(f)) {
+        free(buf);
+        return NULL;
+    }
+    return buf;
+}
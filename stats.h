@@ -0,0 +1,29 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The parts of a request that get timed, in the order they happen.
+ * A part that didn't happen (no CGI, say) doesn't get counted.
+ */
+enum stats_phase {
+    STATS_READ,                 /* request line in */
+    STATS_PARSE,                /* rest of the header block in */
+    STATS_VHOST,                /* vhost directory found */
+    STATS_OPEN,                 /* file opened (or found in the cache) */
+    STATS_CGI,                  /* CGI's header block in */
+    STATS_HEADER,               /* response header written */
+    STATS_SEND,                 /* response out */
+    STATS_TOTAL,                /* all of it */
+    STATS_PHASES
+};
+
+int stats_init(void);
+uint64_t stats_now(void);
+int stats_vhost(const char *name);
+void stats_record(int vhost, int code, uint64_t begin, const uint64_t *stamps, uint64_t end);
+char *stats_render(int prometheus, size_t *len);
+
+#endif
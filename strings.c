@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <ctype.h>
+#include <string.h>
 #include "strings.h"
+#include "simd.h"
 
 int
 endswith(char *haystack, char *needle)
@@ -45,34 +47,20 @@ sanitize(char *s)
 size_t
 extract_header_field(char *buf, char **val, int cgi)
 {
-    size_t len;
+    size_t len = strlen(buf);
+    size_t colon = find_delim(buf, len, ':', '\n', ':', '\n');
 
     *val = NULL;
 
-    for (len = 0; buf[len]; len += 1) {
-        if (! *val) {
-            if (buf[len] == '\n') {
-                /* Blank line or incorrectly-formatted header */
-                break;
-            } else if (buf[len] == ':') {
-                buf[len] = 0;
-                for (*val = &(buf[len+1]); **val == ' '; *val += 1);
-            } else if (cgi) {
-                switch (buf[len]) {
-                    case 'a'...'z':
-                        buf[len] ^= ' ';
-                        break;
-                    case 'A'...'Z':
-                    case '0'...'9':
-                    case '\r':
-                    case '\n':
-                        break;
-                    default:
-                        buf[len] = '_';
-                        break;
-                }
-            }
+    if ((colon < len) && (buf[colon] == ':')) {
+        if (cgi) {
+            field_name(buf, colon);
         }
+        buf[colon] = 0;
+        for (*val = &(buf[colon+1]); **val == ' '; *val += 1);
+    } else {
+        /* Blank line or incorrectly-formatted header */
+        len = colon;
     }
 
     for (; (len > 0) && ((buf[len-1] == '\n') || (buf[len-1] == '\r')); len -= 1);
@@ -95,35 +83,63 @@ fromhex(int c)
     return -1;
 }
 
+/** Escape HTML metacharacters into dst, truncating to fit */
 void
-html_esc(FILE *f, char *s)
+html_esc(char *dst, size_t dstlen, const char *s)
 {
+    char *end = dst + dstlen - 1;
+
     for (; *s; s += 1) {
+        const char *e = NULL;
+
         switch (*s) {
             case '<':
-                fprintf(f, "&lt;");
+                e = "&lt;";
                 break;
             case '>':
-                fprintf(f, "&gt;");
+                e = "&gt;";
                 break;
             case '&':
-                fprintf(f, "&amp;");
+                e = "&amp;";
                 break;
-            default:
-                fputc(*s, f);
+        }
+        if (e) {
+            size_t elen = strlen(e);
+
+            if (dst + elen > end) {
                 break;
+            }
+            memcpy(dst, e, elen);
+            dst += elen;
+        } else {
+            if (dst + 1 > end) {
+                break;
+            }
+            *(dst++) = *s;
         }
     }
+    *dst = 0;
 }
 
+/** Escape things that can't go into a URL into dst, truncating to fit */
 void
-url_esc(FILE *f, char *s)
+url_esc(char *dst, size_t dstlen, const char *s)
 {
+    char *end = dst + dstlen - 1;
+
     for (; *s; s += 1) {
         if ((*s == '%') || (*s == 127) || (*s < 31)) {
-            fprintf(f, "%%%02x", *s);
+            if (dst + 3 > end) {
+                break;
+            }
+            snprintf(dst, 4, "%%%02x", (unsigned char) *s);
+            dst += 3;
         } else {
-            fputc(*s, f);
+            if (dst + 1 > end) {
+                break;
+            }
+            *(dst++) = *s;
         }
     }
+    *dst = 0;
 }
@@ -7,7 +7,7 @@ int endswith(char *haystack, char *needle);
 void sanitize(char *s);
 size_t extract_header_field(char *buf, char **val, int cgi);
 int fromhex(int c);
-void html_esc(FILE *f, char *s);
-void url_esc(FILE *f, char *s);
+void html_esc(char *dst, size_t dstlen, const char *s);
+void url_esc(char *dst, size_t dstlen, const char *s);
 
 #endif
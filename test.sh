@@ -86,9 +86,28 @@ echo "james"
 EOD
 chmod +x default/status.cgi
 
+cat <<'EOD' > default/cat.cgi
+#! /bin/sh
+echo 'Content-type: application/octet-stream'
+echo
+cat
+EOD
+chmod +x default/cat.cgi
+
+cat <<'EOD' > default/length.cgi
+#! /bin/sh
+echo 'Content-type: text/plain'
+echo 'Content-Length: 6'
+echo
+echo james
+EOD
+chmod +x default/length.cgi
+
 mkdir -p default/empty
 mkdir -p default/subdir
 touch default/subdir/a
+touch default/subdir/c
+mkdir -p default/subdir/b
 touch default/subdir/.hidden
 ###
 ###
@@ -104,14 +123,17 @@ echo "IDX:   $HTTPD_IDX  "
 H "Basic tests"
 
 title "GET /index.html"
-printf 'GET /index.html HTTP/1.0\r\n\r\n' | $HTTPD 2>/dev/null | d | grep -q 'HTTP/1.0 200 OK#%Server: eris/[0-9.a-z]*#%Connection: close#%Content-Type: text/html; charset=UTF-8#%Content-Length: 6#%Last-Modified: ..., .. ... 20.. ..:..:.. GMT#%#%james%' && pass || fail
+printf 'GET /index.html HTTP/1.0\r\n\r\n' | $HTTPD 2>/dev/null | d | grep -q 'HTTP/1.0 200 OK#%Server: eris/[0-9.a-z]*#%Connection: close#%Content-Type: text/html; charset=UTF-8#%Content-Length: 6#%Last-Modified: ..., .. ... 20.. ..:..:.. GMT#%ETag: "[0-9a-f-]*"#%Accept-Ranges: bytes#%#%james%' && pass || fail
 
 title "GET /"
-printf 'GET / HTTP/1.0\r\n\r\n' | $HTTPD 2>/dev/null | d | grep -q 'HTTP/1.0 200 OK#%Server: eris/[0-9.a-z]*#%Connection: close#%Content-Type: text/html; charset=UTF-8#%Content-Length: 6#%Last-Modified: ..., .. ... 20.. ..:..:.. GMT#%#%james%' && pass || fail
+printf 'GET / HTTP/1.0\r\n\r\n' | $HTTPD 2>/dev/null | d | grep -q 'HTTP/1.0 200 OK#%Server: eris/[0-9.a-z]*#%Connection: close#%Content-Type: text/html; charset=UTF-8#%Content-Length: 6#%Last-Modified: ..., .. ... 20.. ..:..:.. GMT#%ETag: "[0-9a-f-]*"#%Accept-Ranges: bytes#%#%james%' && pass || fail
 
 title "Keepalive"
 printf 'GET / HTTP/1.1\r\n\r\nGET / HTTP/1.1\r\n\r\n' | $HTTPD 2>/dev/null | grep -c 'james' | grep -q 2 && pass || fail
 
+title "Pipelining"
+printf 'GET / HTTP/1.1\r\n\r\nGET /nope HTTP/1.1\r\n\r\nGET /index.html HTTP/1.1\r\nConnection: close\r\n\r\n' | $HTTPD 2>/dev/null | d | grep -q '^HTTP/1.1 200 .*#%#%james%HTTP/1.1 404 .*HTTP/1.1 200 .*Connection: close#%.*#%#%james%$' && pass || fail
+
 title "POST"
 printf 'POST / HTTP/1.0\r\nContent-Type: a\r\nContent-Length: 5\r\n\r\njames' | $HTTPD 2>/dev/null | d | grep -q 'HTTP/1.0 405 ' && pass || fail
 
@@ -121,6 +143,12 @@ printf 'GET / HTTP/1.2\r\n\r\n' | $HTTPD 2>/dev/null | d | grep -q 'HTTP/1.. 505
 title "HTTP/1.12"
 printf 'GET / HTTP/1.12\r\n\r\n' | $HTTPD 2>/dev/null | d | grep -q 'HTTP/1.. 505 .*ction: close' && pass || fail
 
+title "Append-only output"
+seq 100000 > default/seq.big
+rm -f default/appended
+printf 'GET /seq.big HTTP/1.0\r\n\r\n' | $HTTPD 2>/dev/null >> default/appended
+sed '1,/^\r$/d' default/appended | cmp -s - default/seq.big && pass || fail
+
 title "Bare newline"
 printf 'GET / HTTP/1.0\n\n' | $HTTPD 2>/dev/null | grep -q 'james' && pass || fail
 
@@ -142,6 +170,10 @@ title "Logging busybox"
 (printf 'GET /index.html HTTP/1.1\r\nHost: host\r\n\r\n' | 
     PROTO=TCP TCPREMOTEADDR=[::1]:8765 $HTTPD >/dev/null) 2>&1 | grep -Fxq '[::1]:8765 200 6 host (null) (null) /index.html' && pass || fail
 
+title "Logging times"
+(printf 'GET /index.html HTTP/1.0\r\nHost: host\r\n\r\n' |
+    PROTO=TCP TCPREMOTEPORT=1234 TCPREMOTEIP=10.0.0.2 $HTTPD -L >/dev/null) 2>&1 | grep -q '^10.0.0.2:1234 200 6 host (null) (null) /index.html [0-9]*\.[0-9]\{6\} [1-9][0-9]*$' && pass || fail
+
 title "Logging stunnel"
 (printf 'GET /index.html HTTP/1.1\r\nHost: host\r\n\r\n' | 
     REMOTE_HOST=::1 REMOTE_PORT=8765 $HTTPD >/dev/null) 2>&1 | grep -Fxq '::1:8765 200 6 host (null) (null) /index.html' && pass || fail
@@ -153,6 +185,49 @@ H "Options"
 title "-."
 printf 'GET /eris HTTP/1.0\r\n\r\n' | $HTTPD -. 2>/dev/null | grep -q 'HTTP/1.. 200 OK' && pass || fail
 
+title "Built-in MIME type"
+touch default/app.WASM
+printf 'GET /app.WASM HTTP/1.0\r\n\r\n' | $HTTPD 2>/dev/null | grep -q 'Content-Type: application/wasm' && pass || fail
+
+title "-m"
+touch default/a.frob
+printf 'text/x-frob\tfrob FRIB\n# text/nope frob\n' > default/mime.types
+printf 'GET /a.frob HTTP/1.0\r\n\r\n' | $HTTPD -m default/mime.types 2>/dev/null | grep -q "Content-Type: text/x-frob; charset=UTF-8" && pass || fail
+
+
+
+H "Precompressed"
+
+echo plain text here > default/p.txt
+echo gz > default/p.txt.gz
+
+title "Accept-Encoding gzip"
+printf 'GET /p.txt HTTP/1.0\r\nAccept-Encoding: br, gzip\r\n\r\n' | $HTTPD 2>/dev/null | d | grep -q 'Content-Type: text/plain.*Content-Encoding: gzip.*Vary: Accept-Encoding.*Content-Length: 3#.*gz%$' && pass || fail
+
+title "No Accept-Encoding"
+printf 'GET /p.txt HTTP/1.0\r\n\r\n' | $HTTPD 2>/dev/null | d | grep -q 'Vary: Accept-Encoding.*plain text here%$' && pass || fail
+
+title "q=0"
+printf 'GET /p.txt HTTP/1.0\r\nAccept-Encoding: *, gzip;q=0\r\n\r\n' | $HTTPD 2>/dev/null | grep -q 'plain text here' && pass || fail
+
+title "Stale sidecar"
+touch -d '2001-01-01' default/p.txt.gz
+printf 'GET /p.txt HTTP/1.0\r\nAccept-Encoding: gzip\r\n\r\n' | $HTTPD 2>/dev/null | grep -q 'plain text here' && pass || fail
+
+zdir=${TMPDIR:-/tmp}/eris-test.$$
+seq 1000 > default/seq.txt
+
+title "-z"
+printf 'GET /seq.txt HTTP/1.0\r\nAccept-Encoding: gzip\r\n\r\n' | $HTTPD -z $zdir 2>/dev/null | d | grep -q 'Content-Encoding: gzip' && pass || fail
+
+title "-z again"
+printf 'GET /seq.txt HTTP/1.0\r\nAccept-Encoding: gzip\r\n\r\n' | $HTTPD -z $zdir 2>/dev/null | sed '1,/^\r$/d' | gunzip 2>/dev/null | cmp -s - default/seq.txt && pass || fail
+
+title "-z small file"
+printf 'GET /index.html HTTP/1.0\r\nAccept-Encoding: gzip\r\n\r\n' | $HTTPD -z $zdir 2>/dev/null | grep -q james && pass || fail
+
+rm -rf $zdir
+
 
 
 H "Tomfoolery"
@@ -160,6 +235,9 @@ H "Tomfoolery"
 title "Non-header"
 printf 'GET / HTTP/1.0\r\na: b\r\nfoo\r\n\r\n' | $HTTPD 2>/dev/null | grep -q 'HTTP/1.. 400 ' && pass || fail
 
+title "Space before colon"
+printf 'GET / HTTP/1.0\r\nHost : a\r\n\r\n' | $HTTPD 2>/dev/null | grep -q 'HTTP/1.. 400 ' && pass || fail
+
 title "Huge header field"
 (printf 'GET / HTTP/1.0\r\nHeader: '
  dd if=/dev/zero bs=1k count=9 2>/dev/null | tr '\0' '.'
@@ -171,6 +249,10 @@ title "Too many headers"
      printf 'Header: val\r\n'
  done
  printf '\r\n') | $HTTPD 2>/dev/null | grep -q 'HTTP/1.. 431 ' && pass || fail
+
+title "Split header field"
+(printf 'GET / HTTP/1.0\r\nif-modified'; sleep 0.2
+ printf -- '-SINCE: Sun, 27 Feb 2030 12:12:12 GMT\r\n\r\n') | $HTTPD 2>/dev/null | grep -q 'HTTP/1.. 304 ' && pass || fail
  
  title "Directory traversal"
  printf 'GET /../default/index.html HTTP/1.0\r\n\r\n' | $HTTPD 2>/dev/null | grep -q 'HTTP/1.. 404' && pass || fail
@@ -208,6 +290,54 @@ title "Logging"
 
 
 
+H "Entity tags"
+
+etag=$(printf 'GET / HTTP/1.0\r\n\r\n' | $HTTPD 2>/dev/null | tr -d '\r' | awk -F ': ' '/^ETag/ {print $2;}')
+
+title "If-None-Match"
+printf 'GET / HTTP/1.0\r\nIf-None-Match: %s\r\n\r\n' "$etag" | $HTTPD 2>/dev/null | d | grep -q "HTTP/1.. 304 .*ETag: $etag" && pass || fail
+
+title "If-None-Match list"
+printf 'GET / HTTP/1.0\r\nIf-None-Match: "x", W/%s\r\n\r\n' "$etag" | $HTTPD 2>/dev/null | grep -q 'HTTP/1.. 304 ' && pass || fail
+
+title "If-None-Match *"
+printf 'GET / HTTP/1.0\r\nIf-None-Match: *\r\n\r\n' | $HTTPD 2>/dev/null | grep -q 'HTTP/1.. 304 ' && pass || fail
+
+title "If-None-Match beats IMS"
+printf 'GET / HTTP/1.0\r\nIf-None-Match: "x"\r\nIf-Modified-Since: Sun, 27 Feb 2030 12:12:12 GMT\r\n\r\n' | $HTTPD 2>/dev/null | grep -q 'HTTP/1.. 200 ' && pass || fail
+
+title "If-Range"
+printf 'GET / HTTP/1.0\r\nRange: bytes=1-3\r\nIf-Range: %s\r\n\r\n' "$etag" | $HTTPD 2>/dev/null | d | grep -q 'HTTP/1.0 206 .*Content-Length: 3#' && pass || fail
+
+title "If-Range changed"
+printf 'GET / HTTP/1.0\r\nRange: bytes=1-3\r\nIf-Range: "x"\r\n\r\n' | $HTTPD 2>/dev/null | d | grep -q 'HTTP/1.0 200 .*Content-Length: 6#' && pass || fail
+
+
+
+H "Ranges"
+
+title "Range"
+printf 'GET / HTTP/1.0\r\nRange: bytes=1-3\r\n\r\n' | $HTTPD 2>/dev/null | d | grep -q 'HTTP/1.0 206 .*Content-Range: bytes 1-3/6#.*Content-Length: 3#.*#%ame$' && pass || fail
+
+title "Open range"
+printf 'GET / HTTP/1.0\r\nRange: bytes=4-\r\n\r\n' | $HTTPD 2>/dev/null | d | grep -q 'Content-Range: bytes 4-5/6#.*#%s%$' && pass || fail
+
+title "Suffix range"
+printf 'GET / HTTP/1.0\r\nRange: bytes=-3\r\n\r\n' | $HTTPD 2>/dev/null | d | grep -q 'Content-Range: bytes 3-5/6#.*#%es%$' && pass || fail
+
+title "Unsatisfiable"
+printf 'GET / HTTP/1.0\r\nRange: bytes=6-\r\n\r\n' | $HTTPD 2>/dev/null | d | grep -q 'HTTP/1.0 416 .*Content-Range: bytes \*/6#' && pass || fail
+
+title "Bogus range"
+printf 'GET / HTTP/1.0\r\nRange: bytes=3-1\r\n\r\n' | $HTTPD 2>/dev/null | d | grep -q 'HTTP/1.0 200 .*james%$' && pass || fail
+
+title "Multiple ranges"
+printf 'GET / HTTP/1.0\r\nRange: bytes=0-0,-2\r\n\r\n' | $HTTPD 2>/dev/null > default/multi
+tr -d '\r' < default/multi | awk -F ': ' '/^Content-Length/ {len = $2} /^$/ {exit} END {print len}' > default/multi.len
+sed '1,/^\r$/d' default/multi | wc -c | tr -d ' ' | cmp -s - default/multi.len && d < default/multi | grep -q 'Content-Type: multipart/byteranges; boundary=\([0-9a-f]*\)#.*#%--\1#%Content-Type: text/html; charset=UTF-8#%Content-Range: bytes 0-0/6#%#%j#%--\1#%.*Content-Range: bytes 4-5/6#%#%s%#%--\1--#%$' && pass || fail
+
+
+
 H "Directory indexing"
 
 title "Basic index"
@@ -215,9 +345,13 @@ printf 'GET /empty/ HTTP/1.0\r\n\r\n' | $HTTPD_IDX 2>/dev/null | d | grep -Fq '<
 title "Hidden file"
 printf 'GET /subdir/ HTTP/1.0\r\n\r\n' | $HTTPD_IDX 2>/dev/null | grep -q 'hidden' && fail || pass
 
+title "Sorted index, kept alive"
+printf 'GET /subdir/ HTTP/1.1\r\nHost: a\r\n\r\nGET /a HTTP/1.1\r\nHost: a\r\nConnection: close\r\n\r\n' | $HTTPD_IDX 2>/dev/null | d | \
+    grep -q '^HTTP/1.1 200 OK#%Server: [^#]*#%Connection: keep-alive#%.*Content-Length: [0-9]*#%.*"a">a</a>%.*"b/">b</a>%.*"c">c</a>%</pre></body></html>HTTP/1.1 200 ' && pass || fail
+
 title "Logging"
 (printf 'GET /empty/ HTTP/1.0\r\n\r\n' |
-    PROTO=TCP TCPREMOTEPORT=1234 TCPREMOTEIP=10.0.0.2 $HTTPD_IDX >/dev/null) 2>&1 | grep -q '^10.0.0.2:1234 200 0 (null) (null) (null) /empty/$' && pass || fail
+    PROTO=TCP TCPREMOTEPORT=1234 TCPREMOTEIP=10.0.0.2 $HTTPD_IDX >/dev/null) 2>&1 | grep -q '^10.0.0.2:1234 200 [1-9][0-9]* (null) (null) (null) /empty/$' && pass || fail
 
 
 H "CGI"
@@ -255,6 +389,14 @@ printf 'GET /a.cgi HTTP/1.0\r\n\r\n' | $HTTPD_CGI 2>/dev/null | d | grep -Eq '%S
 title "Large response"
 printf 'GET /mongo.cgi HTTP/1.0\r\n\r\n' | $HTTPD_CGI 2>/dev/null | grep -q james && pass || fail
 
+title "Large chunked response"
+printf 'GET /mongo.cgi HTTP/1.1\r\nHost: a\r\n\r\nGET /a HTTP/1.1\r\nHost: a\r\nConnection: close\r\n\r\n' | $HTTPD_CGI 2>/dev/null | d | grep -q 'james%#%0#%#%HTTP/1.1 200 ' && pass || fail
+
+title "Append-only CGI output"
+rm -f default/appended
+printf 'GET /mongo.cgi HTTP/1.0\r\n\r\n' | $HTTPD_CGI 2>/dev/null >> default/appended
+sed '1,/^\r$/d' default/appended | wc -c | grep -q '^800006$' && pass || fail
+
 title "Redirect"
 printf 'GET /redir.cgi HTTP/1.0\r\n\r\n' | $HTTPD_CGI 2>/dev/null | grep -Fq 'Location: http://example.com/froot' && pass || fail
 
@@ -267,6 +409,25 @@ printf 'GET /status.cgi/empty HTTP/1.0\r\n\r\n' | $HTTPD_CGI 2>/dev/null | d | g
 title "No status"
 printf 'GET /status.cgi/nostat HTTP/1.0\r\n\r\n' | $HTTPD_CGI 2>/dev/null | d | grep -q '^HTTP/1.0 500 ' && pass || fail
 
+title "Large POST"
+(printf 'POST /cat.cgi HTTP/1.0\r\nContent-Length: %d\r\n\r\n' $(wc -c < default/seq.big); cat default/seq.big) | \
+    $HTTPD_CGI 2>/dev/null | sed '1,/^\r$/d' | cmp -s - default/seq.big && pass || fail
+
+title "Chunked keepalive"
+printf 'GET /status.cgi HTTP/1.1\r\nHost: a\r\n\r\nGET /status.cgi HTTP/1.1\r\nHost: a\r\nConnection: close\r\n\r\n' | \
+    $HTTPD_CGI 2>/dev/null | d | grep -q '^HTTP/1.1 300 wat#%.*Connection: keep-alive#%.*Transfer-Encoding: chunked#%#%6#%james%#%0#%#%HTTP/1.1 300 .*Connection: close#%.*%james%$' && pass || fail
+
+title "Content-Length keepalive"
+printf 'GET /length.cgi HTTP/1.1\r\nHost: a\r\n\r\nGET /a HTTP/1.1\r\nHost: a\r\nConnection: close\r\n\r\n' | \
+    $HTTPD_CGI 2>/dev/null | d | grep -q '^HTTP/1.1 200 OK#%.*Connection: keep-alive#%.*Content-Length: 6#%#%james%HTTP/1.1 200 ' && pass || fail
+
+title "Chunked POST"
+printf 'POST /cat.cgi HTTP/1.1\r\nHost: a\r\nTransfer-Encoding: chunked\r\n\r\n3;x=y\r\narf\r\n5\r\n meow\r\n0\r\nX-T: 1\r\n\r\nGET /a HTTP/1.1\r\nHost: a\r\nConnection: close\r\n\r\n' | \
+    $HTTPD_CGI 2>/dev/null | d | grep -q '^HTTP/1.1 200 OK#%.*Connection: keep-alive#%.*#%#%8#%arf meow#%0#%#%HTTP/1.1 200 ' && pass || fail
+
+title "Unknown transfer coding"
+printf 'POST /cat.cgi HTTP/1.1\r\nHost: a\r\nTransfer-Encoding: gzip\r\n\r\n' | $HTTPD_CGI 2>/dev/null | grep -q '^HTTP/1.1 501 ' && pass || fail
+
 
 H "Timeouts"
 
@@ -280,6 +441,184 @@ title "Basic test"
 printf 'CONNECT /etc HTTP/1.1\r\n\r\n' | $HTTPD -o /bin/ls | grep -q passwd && pass || fail
 
 
+H "Listener"
+
+if command -v curl >/dev/null; then
+    port=$(expr 20000 + $$ % 10000)
+    $HTTPD_CGI -l 127.0.0.1:$port -w 2 2>/dev/null &
+    listener=$!
+    sleep 0.5
+
+    title "Basic GET"
+    curl -s http://127.0.0.1:$port/ | grep -q james && pass || fail
+
+    title "Keepalive"
+    curl -s http://127.0.0.1:$port/ http://127.0.0.1:$port/index.html | grep -c james | grep -q 2 && pass || fail
+
+    title "Bad request survives"
+    printf 'BLARG / HTTP/1.0\r\n\r\n' | curl -s telnet://127.0.0.1:$port >/dev/null
+    curl -s http://127.0.0.1:$port/ | grep -q james && pass || fail
+
+    title "CGI environment"
+    curl -s -H 'X-Merf: 1' http://127.0.0.1:$port/a.cgi >/dev/null
+    curl -s http://127.0.0.1:$port/a.cgi | grep -q HTTP_X_MERF && fail || pass
+
+    kill $listener
+
+    eport=$(expr $port + 1)
+    $HTTPD_CGI -l 127.0.0.1:$eport -w 1 -e 2>/dev/null &
+    listener=$!
+    sleep 0.5
+
+    title "Event loop keepalive"
+    curl -s http://127.0.0.1:$eport/ http://127.0.0.1:$eport/index.html | grep -c james | grep -q 2 && pass || fail
+
+    title "Event loop pipelining"
+    (printf 'GET / HTTP/1.1\r\n\r\nGET /a HTTP/1.1\r\nConnection: close\r\n\r\n'; sleep 0.5) | curl -s telnet://127.0.0.1:$eport | grep -c '^HTTP/1.1' | grep -q 2 && pass || fail
+
+    title "Event loop CGI"
+    curl -s "http://127.0.0.1:$eport/a.cgi?q=1" | grep -q "QUERY_STRING='q=1'" && pass || fail
+
+    title "Event loop after CGI"
+    curl -s http://127.0.0.1:$eport/ | grep -q james && pass || fail
+
+    title "Event loop kept response"
+    (printf 'GET /index.html HTTP/1.1\r\n\r\nGET /index.html HTTP/1.0\r\n\r\n'; sleep 0.5) | curl -s telnet://127.0.0.1:$eport | d | grep -q 'HTTP/1.1 200 .*Connection: keep-alive.*james%HTTP/1.0 200 .*Connection: close.*Content-Length: 6.*james%$' && pass || fail
+
+    title "Event loop changed file"
+    echo one > default/cached
+    curl -s http://127.0.0.1:$eport/cached http://127.0.0.1:$eport/cached >/dev/null
+    echo two three > default/cached
+    sleep 0.2
+    curl -s http://127.0.0.1:$eport/cached http://127.0.0.1:$eport/cached | grep -c 'two three' | grep -q 2 && pass || fail
+
+    kill $listener
+
+    uport=$(expr $port + 2)
+    $HTTPD_CGI -l 127.0.0.1:$uport -w 1 -u 2>/dev/null &
+    listener=$!
+    sleep 0.5
+
+    title "io_uring keepalive"
+    curl -s http://127.0.0.1:$uport/ http://127.0.0.1:$uport/index.html | grep -c james | grep -q 2 && pass || fail
+
+    title "io_uring 404"
+    curl -s -o /dev/null -w '%{http_code}' http://127.0.0.1:$uport/nonexistent | grep -q 404 && pass || fail
+
+    title "io_uring pipelining"
+    (printf 'GET / HTTP/1.1\r\n\r\nGET /nope HTTP/1.1\r\n\r\nGET / HTTP/1.1\r\nConnection: close\r\n\r\n'; sleep 0.5) | curl -s telnet://127.0.0.1:$uport | d | grep -q 'james%HTTP/1.1 404 .*HTTP/1.1 200 .*james%$' && pass || fail
+
+    title "io_uring CGI"
+    curl -s "http://127.0.0.1:$uport/a.cgi?q=1" | grep -q "QUERY_STRING='q=1'" && pass || fail
+
+    title "io_uring removed file"
+    curl -s http://127.0.0.1:$uport/cached >/dev/null
+    rm default/cached
+    sleep 0.2
+    curl -s -o /dev/null -w '%{http_code}' http://127.0.0.1:$uport/cached | grep -q 404 && pass || fail
+
+    kill $listener
+
+    tport=$(expr $port + 3)
+    $HTTPD_CGI -l 127.0.0.1:$tport -w 1 -t 4 2>/dev/null &
+    listener=$!
+    sleep 0.5
+
+    title "Threads keepalive"
+    curl -s http://127.0.0.1:$tport/ http://127.0.0.1:$tport/index.html | grep -c james | grep -q 2 && pass || fail
+
+    title "Threads CGI POST"
+    curl -s -d 'a=1' http://127.0.0.1:$tport/a.cgi | grep -q "CONTENT_LENGTH='3'" && pass || fail
+
+    title "Threads after CGI"
+    curl -s http://127.0.0.1:$tport/ | grep -q james && pass || fail
+
+    kill $listener
+
+    log=${TMPDIR:-/tmp}/eris-log.$$
+    lport=$(expr $port + 4)
+    $HTTPD -l 127.0.0.1:$lport -w 1 -L 2>$log &
+    listener=$!
+    sleep 0.5
+
+    title "Log written on the way out"
+    curl -s http://127.0.0.1:$lport/index.html >/dev/null
+    kill $listener
+    sleep 0.5
+    grep -q '^127.0.0.1:[0-9]* 200 6 127.0.0.1:[0-9]* curl/[^ ]* (null) /index.html [0-9]*\.[0-9]\{6\} [1-9][0-9]*$' $log && pass || fail
+    rm -f $log
+
+    sport=$(expr $port + 5)
+    $HTTPD -l 127.0.0.1:$sport -w 1 -S 2>$log &
+    listener=$!
+    sleep 0.5
+    curl -s http://127.0.0.1:$sport/index.html http://127.0.0.1:$sport/nope >/dev/null
+
+    title "Status endpoint"
+    curl -s http://127.0.0.1:$sport/.well-known/eris-status | grep -q '^[^ ]* 4xx total 1 [0-9]* [0-9]* [0-9]* [0-9]* [0-9]*$' && pass || fail
+
+    title "Status for Prometheus"
+    curl -s "http://127.0.0.1:$sport/.well-known/eris-status?format=prometheus" | grep -q '^eris_phase_seconds_count{vhost="[^"]*",status="2xx",phase="open"} 1$' && pass || fail
+
+    title "Status on SIGUSR1"
+    kill -USR1 $listener
+    sleep 0.5
+    grep -q '^- 2xx total [1-9]' $log && pass || fail
+    kill $listener
+    rm -f $log
+fi
+
+
+H "Backends"
+
+bdir=${TMPDIR:-/tmp}/eris-backend.$$
+mkdir -p $bdir
+if cc -o $bdir/echo-backend contrib/echo-backend.c 2>/dev/null; then
+    $bdir/echo-backend scgi $bdir/scgi.sock &
+    scgi=$!
+    $bdir/echo-backend fcgi $bdir/fcgi.sock &
+    fcgi=$!
+    sleep 0.5
+
+    title "SCGI GET"
+    printf 'GET /a.cgi/merf?foo HTTP/1.0\r\n\r\n' | $HTTPD -b scgi:$bdir/scgi.sock 2>/dev/null | d | grep -q 'HTTP/1.0 200 OK#%.*%SCGI=1%.*%QUERY_STRING=foo%PATH_INFO=/merf%.*%SCRIPT_FILENAME=/.*/a.cgi%$' && pass || fail
+
+    title "SCGI POST"
+    printf 'POST /a.cgi HTTP/1.0\r\nContent-Length: 3\r\n\r\narf' | $HTTPD -b scgi:$bdir/scgi.sock 2>/dev/null | d | grep -q '^HTTP/1.0 200 .*%CONTENT_LENGTH=3%.*%arf$' && pass || fail
+
+    title "FastCGI POST"
+    printf 'POST /a.cgi HTTP/1.0\r\nContent-Type: moo\r\nContent-Length: 3\r\n\r\narf' | $HTTPD -b fcgi:$bdir/fcgi.sock 2>/dev/null | d | grep -q '^HTTP/1.0 200 .*%CONTENT_LENGTH=3%CONTENT_TYPE=moo%.*%arf$' && pass || fail
+
+    title "FastCGI chunked POST"
+    printf 'POST /a.cgi HTTP/1.0\r\nTransfer-Encoding: chunked\r\n\r\n3\r\narf\r\n2\r\nxy\r\n0\r\n\r\n' | $HTTPD -b fcgi:$bdir/fcgi.sock 2>/dev/null | d | grep -q '^HTTP/1.0 200 .*%HTTP_TRANSFER_ENCODING=chunked%.*%arfxy$' && pass || fail
+
+    title "SCGI chunked POST"
+    printf 'POST /a.cgi HTTP/1.0\r\nTransfer-Encoding: chunked\r\n\r\n3\r\narf\r\n0\r\n\r\n' | $HTTPD -b scgi:$bdir/scgi.sock 2>/dev/null | grep -q '^HTTP/1.0 411 ' && pass || fail
+
+    title "Backend not there"
+    printf 'GET /a.cgi HTTP/1.0\r\n\r\n' | $HTTPD -b fcgi:$bdir/nope.sock 2>/dev/null | grep -q '^HTTP/1.0 502 ' && pass || fail
+
+    title "Backend with an event loop"
+    $HTTPD -l 127.0.0.1:0 -e -b fcgi:$bdir/fcgi.sock 2>&1 | grep -q 'use -t' && pass || fail
+
+    if command -v curl >/dev/null; then
+        bport=$(expr 20000 + $$ % 10000 + 4)
+        $HTTPD -l 127.0.0.1:$bport -w 1 -t 2 -b fcgi:$bdir/fcgi.sock 2>/dev/null &
+        listener=$!
+        sleep 0.5
+
+        title "FastCGI connection reuse"
+        curl -s http://127.0.0.1:$bport/a.cgi >/dev/null
+        curl -s http://127.0.0.1:$bport/a.cgi | grep -q '^REQUEST=2$' && pass || fail
+
+        kill $listener
+    fi
+
+    kill $scgi $fcgi
+fi
+rm -rf $bdir
+
+
 H "fnord bugs"
 
 # 1. Should return directory listing of /; instead segfaults
@@ -0,0 +1,199 @@
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+static int
+uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+uring_register(int fd, unsigned opcode, void *arg, unsigned nr)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr);
+}
+
+/*
+ * Check that the kernel knows how to do everything we're going to ask
+ */
+static int
+uring_probe(int fd, const int *ops, int nops)
+{
+    char buf[sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op)];
+    struct io_uring_probe *probe = (struct io_uring_probe *) buf;
+    int i;
+
+    memset(buf, 0, sizeof buf);
+    if (-1 == uring_register(fd, IORING_REGISTER_PROBE, probe, 256)) {
+        return -1;
+    }
+    for (i = 0; i < nops; i += 1) {
+        if ((ops[i] > probe->last_op) || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+            errno = EOPNOTSUPP;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Set up a ring that can do the operations in ops.
+ * Returns -1 with errno set if the kernel can't.
+ */
+int
+uring_init(struct uring *u, unsigned entries, const int *ops, int nops)
+{
+    struct io_uring_params p;
+    char *sq, *cq;
+    unsigned i;
+
+    memset(u, 0, sizeof *u);
+    memset(&p, 0, sizeof p);
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;
+    u->fd = uring_setup(entries, &p);
+    if (-1 == u->fd) {
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_NODROP) || (-1 == uring_probe(u->fd, ops, nops))) {
+        goto fail;
+    }
+
+    u->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_len > u->sq_len) {
+            u->sq_len = u->cq_len;
+        }
+        u->cq_len = 0;
+    }
+
+    u->sq_map = mmap(NULL, u->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (MAP_FAILED == u->sq_map) {
+        u->sq_map = NULL;
+        goto fail;
+    }
+    if (u->cq_len) {
+        u->cq_map = mmap(NULL, u->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if (MAP_FAILED == u->cq_map) {
+            u->cq_map = NULL;
+            goto fail;
+        }
+    }
+    u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (MAP_FAILED == u->sqes) {
+        u->sqes = NULL;
+        goto fail;
+    }
+
+    sq = u->sq_map;
+    cq = u->cq_len ? u->cq_map : u->sq_map;
+    u->sq_head = (unsigned *) (sq + p.sq_off.head);
+    u->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    u->sq_entries = p.sq_entries;
+    u->cq_head = (unsigned *) (cq + p.cq_off.head);
+    u->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    /*
+     * SQEs always go in the slot with the same index
+     */
+    for (i = 0; i < p.sq_entries; i += 1) {
+        ((unsigned *) (sq + p.sq_off.array))[i] = i;
+    }
+    u->sqe_tail = *u->sq_tail;
+
+    return 0;
+
+  fail:
+    i = errno;
+    uring_free(u);
+    errno = i;
+    return -1;
+}
+
+void
+uring_free(struct uring *u)
+{
+    if (u->sqes) {
+        munmap(u->sqes, u->sqes_len);
+    }
+    if (u->cq_map) {
+        munmap(u->cq_map, u->cq_len);
+    }
+    if (u->sq_map) {
+        munmap(u->sq_map, u->sq_len);
+    }
+    close(u->fd);
+    memset(u, 0, sizeof *u);
+    u->fd = -1;
+}
+
+/*
+ * Get a cleared SQE, submitting what's queued if the ring is full.
+ * Returns NULL if the kernel won't take any more.
+ *
+ * The caller fills it in; it goes in the ring at the next uring_enter(),
+ * so it has to be filled in before then.
+ */
+struct io_uring_sqe *
+uring_sqe(struct uring *u)
+{
+    struct io_uring_sqe *sqe;
+
+    while (u->sqe_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+        if ((-1 == uring_enter(u, 0)) && (errno != EINTR)) {
+            return NULL;
+        }
+    }
+
+    sqe = &u->sqes[u->sqe_tail & *u->sq_mask];
+    memset(sqe, 0, sizeof *sqe);
+    u->sqe_tail += 1;
+
+    return sqe;
+}
+
+/*
+ * Submit everything queued, and wait for at least wait completions.
+ * The release store is what makes the filled-in SQEs visible to the kernel.
+ */
+int
+uring_enter(struct uring *u, unsigned wait)
+{
+    unsigned queued;
+
+    __atomic_store_n(u->sq_tail, u->sqe_tail, __ATOMIC_RELEASE);
+    queued = u->sqe_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+
+    return syscall(__NR_io_uring_enter, u->fd, queued, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+/*
+ * The next completion, or NULL if there aren't any
+ */
+struct io_uring_cqe *
+uring_cqe(struct uring *u)
+{
+    unsigned head = *u->cq_head;
+
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+
+    return &u->cqes[head & *u->cq_mask];
+}
+
+void
+uring_cqe_seen(struct uring *u)
+{
+    __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
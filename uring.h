@@ -0,0 +1,30 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+/*
+ * Just enough io_uring to get by without liburing
+ */
+struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    unsigned sq_entries;
+    unsigned sqe_tail;          /* SQEs handed out: the kernel sees them at uring_enter() */
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+
+    void *sq_map, *cq_map;
+    size_t sq_len, cq_len, sqes_len;
+};
+
+int uring_init(struct uring *u, unsigned entries, const int *ops, int nops);
+void uring_free(struct uring *u);
+struct io_uring_sqe *uring_sqe(struct uring *u);
+int uring_enter(struct uring *u, unsigned wait);
+struct io_uring_cqe *uring_cqe(struct uring *u);
+void uring_cqe_seen(struct uring *u);
+
+#endif
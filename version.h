@@ -0,0 +1 @@
+const char *FNORD = "eris/5.0";
@@ -0,0 +1,346 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <signal.h>
+#include <pthread.h>
+#include <zlib.h>
+#include "zcache.h"
+
+/*
+ * Gzipped copies of files, made the first time somebody asks for one.
+ *
+ * A copy is named for what it was made from (device, inode, mtime,
+ * size), so a file that changes just gets a new copy, and every worker
+ * and thread finds the same one.  Whoever manages to create NAME.tmp
+ * does the compressing; anybody who wants it in the meantime sends the
+ * file as it is.  A copy that wouldn't be any smaller is left empty,
+ * so nobody tries again.
+ *
+ * Workers don't talk to each other about how big the directory is.
+ * Each one adds it up again after writing an eighth of maxbytes,
+ * and throws out the oldest copies until it's down to three quarters.
+ */
+
+#define ZCACHE_MIN 256                  /* smaller than this isn't worth it */
+#define ZCACHE_MAX (4 * 1024 * 1024)    /* bigger than this takes too long */
+#define ZCACHE_STALE 60                 /* seconds before a .tmp is abandoned */
+#define ZCACHE_LEVEL 6
+#define ZCACHE_BUFSIZE (64 * 1024)
+
+static int dir = -1;
+static off_t maxbytes;
+static off_t written;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct copy {
+    time_t mtime;
+    off_t size;
+    char name[80];
+};
+
+static int
+oldest_first(const void *a, const void *b)
+{
+    const struct copy *x = a, *y = b;
+
+    return (x->mtime > y->mtime) - (x->mtime < y->mtime);
+}
+
+/*
+ * Add up the directory, and clear out enough of it.
+ * Call with the lock held.
+ */
+static void
+prune(void)
+{
+    struct copy *copies = NULL;
+    size_t ncopies = 0, size = 0;
+    off_t total = 0;
+    time_t now = time(NULL);
+    struct dirent *de;
+    DIR *d;
+    int fd;
+    size_t i;
+
+    written = 0;
+    if ((fd = dup(dir)) == -1) {
+        return;
+    }
+    if (!(d = fdopendir(fd))) {
+        close(fd);
+        return;
+    }
+    rewinddir(d);
+
+    while ((de = readdir(d))) {
+        struct stat st;
+        size_t len = strlen(de->d_name);
+
+        if ((de->d_name[0] == '.') || (len >= sizeof copies->name)) {
+            continue;
+        }
+        if (fstatat(dir, de->d_name, &st, AT_SYMLINK_NOFOLLOW) || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        if ((len > 4) && !strcmp(de->d_name + len - 4, ".tmp")) {
+            if (now - st.st_mtime > ZCACHE_STALE) {
+                unlinkat(dir, de->d_name, 0);
+            }
+            continue;
+        }
+
+        if (ncopies == size) {
+            struct copy *p;
+
+            size = size ? size * 2 : 256;
+            if (!(p = realloc(copies, size * sizeof *p))) {
+                break;
+            }
+            copies = p;
+        }
+        copies[ncopies].mtime = st.st_mtime;
+        copies[ncopies].size = st.st_size;
+        memcpy(copies[ncopies].name, de->d_name, len + 1);
+        ncopies += 1;
+        total += st.st_size;
+    }
+    closedir(d);
+
+    if (total > maxbytes) {
+        qsort(copies, ncopies, sizeof *copies, oldest_first);
+        for (i = 0; (i < ncopies) && (total > maxbytes / 4 * 3); i += 1) {
+            if (!unlinkat(dir, copies[i].name, 0)) {
+                total -= copies[i].size;
+            }
+        }
+    }
+    free(copies);
+}
+
+/*
+ * Use dir for compressed copies, up to maxbytes of them.
+ */
+int
+zcache_init(const char *path, off_t max)
+{
+    if (mkdir(path, 0700) && (errno != EEXIST)) {
+        return -1;
+    }
+    dir = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (-1 == dir) {
+        return -1;
+    }
+    maxbytes = max;
+    prune();
+    return 0;
+}
+
+/*
+ * Gzip len bytes of in to out.
+ * Returns how much it wrote, or -1.
+ */
+static off_t
+gzip(int in, int out, off_t len)
+{
+    unsigned char *ibuf = malloc(ZCACHE_BUFSIZE);
+    unsigned char *obuf = malloc(ZCACHE_BUFSIZE);
+    z_stream z = {0};
+    off_t off = 0;
+    off_t ret = -1;
+    int flush;
+
+    if (!ibuf || !obuf) {
+        goto done;
+    }
+    if (deflateInit2(&z, ZCACHE_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        goto done;
+    }
+
+    do {
+        ssize_t n = pread(in, ibuf, (len - off < ZCACHE_BUFSIZE) ? len - off : ZCACHE_BUFSIZE, off);
+
+        if (n < 0) {
+            goto end;
+        }
+        off += n;
+        flush = ((n == 0) || (off >= len)) ? Z_FINISH : Z_NO_FLUSH;
+        z.next_in = ibuf;
+        z.avail_in = n;
+        do {
+            size_t have;
+
+            z.next_out = obuf;
+            z.avail_out = ZCACHE_BUFSIZE;
+            deflate(&z, flush);
+            have = ZCACHE_BUFSIZE - z.avail_out;
+            if (write(out, obuf, have) != have) {
+                goto end;
+            }
+        } while (z.avail_out == 0);
+    } while (flush != Z_FINISH);
+    ret = z.total_out;
+
+  end:
+    deflateEnd(&z);
+  done:
+    free(ibuf);
+    free(obuf);
+    return ret;
+}
+
+/*
+ * Open a copy that's already been made.
+ * Returns -1 if there isn't one, or ZCACHE_NONE if it didn't get smaller.
+ */
+static int
+open_made(const char *name, off_t *len)
+{
+    struct stat zst;
+    int zfd = openat(dir, name, O_RDONLY | O_CLOEXEC);
+
+    if (zfd != -1) {
+        if (fstat(zfd, &zst) || (zst.st_size == 0)) {
+            close(zfd);
+            return ZCACHE_NONE;
+        }
+        *len = zst.st_size;
+    }
+    return zfd;
+}
+
+/*
+ * What the copy of a file with stat st is called
+ */
+static void
+copy_name(const struct stat *st, char *name, size_t size)
+{
+    snprintf(name, size, "%llx-%llx-%llx.%09ld-%llx.gz",
+             (unsigned long long) st->st_dev, (unsigned long long) st->st_ino,
+             (unsigned long long) st->st_mtim.tv_sec, st->st_mtim.tv_nsec,
+             (unsigned long long) st->st_size);
+}
+
+/*
+ * Open the gzipped copy of a file (whose stat is st), if it's been made.
+ *
+ * Returns an fd for the caller to close, and its length in *len;
+ * -1 if it hasn't been made; or ZCACHE_NONE if there won't ever be one.
+ */
+int
+zcache_find(const struct stat *st, off_t *len)
+{
+    char name[80];
+
+    if (-1 == dir) {
+        return -1;
+    }
+    if ((st->st_size < ZCACHE_MIN) || (st->st_size > ZCACHE_MAX)) {
+        return ZCACHE_NONE;
+    }
+    copy_name(st, name, sizeof name);
+    return open_made(name, len);
+}
+
+/*
+ * Is somebody making the copy of a file with stat st right now?
+ */
+int
+zcache_making(const struct stat *st)
+{
+    char tmp[90];
+
+    copy_name(st, tmp, sizeof tmp);
+    strcat(tmp, ".tmp");
+    return !faccessat(dir, tmp, F_OK, 0);
+}
+
+/*
+ * Open the gzipped copy of fd (whose stat is st), making it if need be.
+ *
+ * Returns an fd for the caller to close, and its length in *len;
+ * -1 if there isn't one right now; or ZCACHE_NONE if there won't ever be.
+ */
+int
+zcache_open(int fd, const struct stat *st, off_t *len)
+{
+    char name[80], tmp[90];
+    sigset_t alrm, omask;
+    off_t zlen;
+    int zfd, made;
+
+    if (-1 == dir) {
+        return -1;
+    }
+    if ((st->st_size < ZCACHE_MIN) || (st->st_size > ZCACHE_MAX)) {
+        return ZCACHE_NONE;
+    }
+
+    copy_name(st, name, sizeof name);
+    zfd = open_made(name, len);
+    if (zfd != -1) {
+        return zfd;
+    }
+
+    /*
+     * Serving from stdin, a timeout is SIGALRM killing the process:
+     * hold it off until the .tmp is dealt with.  Nothing else sends it.
+     */
+    sigemptyset(&alrm);
+    sigaddset(&alrm, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &alrm, &omask);
+
+    snprintf(tmp, sizeof tmp, "%s.tmp", name);
+    zfd = openat(dir, tmp, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (-1 == zfd) {
+        /*
+         * Somebody else is on it
+         */
+        goto done;
+    }
+
+    /*
+     * Somebody else might have finished it, and taken their .tmp away,
+     * between our looking and our making one
+     */
+    made = open_made(name, len);
+    if (made != -1) {
+        unlinkat(dir, tmp, 0);
+        close(zfd);
+        zfd = made;
+        goto done;
+    }
+
+    zlen = gzip(fd, zfd, st->st_size);
+    if (zlen >= st->st_size) {
+        zlen = ftruncate(zfd, 0) ? -1 : 0;
+    }
+    if ((zlen == -1) || renameat(dir, tmp, dir, name)) {
+        unlinkat(dir, tmp, 0);
+        close(zfd);
+        zfd = -1;
+        goto done;
+    }
+
+    pthread_mutex_lock(&lock);
+    written += zlen;
+    if (written > maxbytes / 8) {
+        prune();
+    }
+    pthread_mutex_unlock(&lock);
+
+    if (zlen == 0) {
+        close(zfd);
+        zfd = ZCACHE_NONE;
+    } else {
+        *len = zlen;
+    }
+
+  done:
+    pthread_sigmask(SIG_SETMASK, &omask, NULL);
+    return zfd;
+}
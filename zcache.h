@@ -0,0 +1,15 @@
+#ifndef __ZCACHE_H__
+#define __ZCACHE_H__
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* zcache_open() has nothing for this file, and never will */
+#define ZCACHE_NONE -2
+
+int zcache_init(const char *dir, off_t maxbytes);
+int zcache_open(int fd, const struct stat *st, off_t *len);
+int zcache_find(const struct stat *st, off_t *len);
+int zcache_making(const struct stat *st);
+
+#endif